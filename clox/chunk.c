@@ -1,6 +1,9 @@
 #include "chunk.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include "memory.h"
+#include "object.h"
 #include "vector.h"
 #include "value.h"
 #include "uint.h"
@@ -11,6 +14,9 @@ void chunk_init(Chunk *chunk)
     VECTOR_INIT(chunk, code);
     valuearray_init(&chunk->constants);
     chunk->lines = NULL;
+    chunk->caches = NULL;
+    chunk->cache_size = 0;
+    chunk->cache_cap = 0;
 }
 
 void chunk_write(Chunk *chunk, u8 byte, int line)
@@ -31,6 +37,7 @@ void chunk_free(Chunk *chunk)
     FREE_ARRAY(u8, chunk->code, chunk->cap);
     FREE_ARRAY(int, chunk->lines, chunk->cap);
     valuearray_free(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_cap);
     chunk_init(chunk);
 }
 
@@ -41,3 +48,174 @@ size_t chunk_add_const(Chunk *chunk, Value value)
     vm_pop(value);
     return chunk->constants.size - 1;
 }
+
+size_t chunk_add_cache(Chunk *chunk)
+{
+    if (chunk->cache_cap < chunk->cache_size + 1) {
+        size_t old = chunk->cache_cap;
+        chunk->cache_cap = vector_grow_cap(old);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old, chunk->cache_cap);
+    }
+    InlineCache *cache = &chunk->caches[chunk->cache_size];
+    cache->size = 0;
+    cache->megamorphic = false;
+    return chunk->cache_size++;
+}
+
+size_t chunk_instr_size(Chunk *chunk, size_t offset)
+{
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+        return 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SUPER_INVOKE:
+    case OP_BRANCH:
+    case OP_BRANCH_FALSE:
+    case OP_BRANCH_BACK:
+    case OP_GET_LOCAL2:
+    case OP_INC_LOCAL:
+    case OP_BRANCH_NOT_LESS:
+    case OP_BRANCH_NOT_GREATER:
+    case OP_BRANCH_NOT_LESS_EQ:
+    case OP_BRANCH_NOT_GREATER_EQ:
+        return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_FIELD:
+        return 4;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+        return 5;
+    case OP_CLOSURE: {
+        ObjFunction *fun = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + fun->upvalue_count * 2;
+    }
+    default:
+        return 1;
+    }
+}
+
+// -1 if the instruction at offset doesn't branch
+long chunk_branch_target(Chunk *chunk, size_t offset)
+{
+    u8 *code = &chunk->code[offset];
+    switch (code[0]) {
+    case OP_BRANCH:
+    case OP_BRANCH_FALSE:
+    case OP_BRANCH_NOT_LESS:
+    case OP_BRANCH_NOT_GREATER:
+    case OP_BRANCH_NOT_LESS_EQ:
+    case OP_BRANCH_NOT_GREATER_EQ:
+        return offset + 3 + (code[1] << 8 | code[2]);
+    case OP_BRANCH_BACK:
+        return offset + 3 - (code[1] << 8 | code[2]);
+    default:
+        return -1;
+    }
+}
+
+// how many values the instruction at offset leaves on the stack, less what it takes
+static int stack_effect(Chunk *chunk, size_t offset)
+{
+    u8 *code = &chunk->code[offset];
+    switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+        return 1;
+    case OP_GET_LOCAL2:
+        return 2;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQ:
+    case OP_NOT_EQ:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_LESS_EQ:
+    case OP_GREATER_EQ:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_PRINT:
+    case OP_RETURN:
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+    case OP_INHERIT:
+        return -1;
+    case OP_BRANCH_NOT_LESS:
+    case OP_BRANCH_NOT_GREATER:
+    case OP_BRANCH_NOT_LESS_EQ:
+    case OP_BRANCH_NOT_GREATER_EQ:
+        return -2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return -code[1];
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+        return -code[2];
+    case OP_SUPER_INVOKE:
+        return -code[2] - 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * the most values a call to the chunk's function ever has on the stack,
+ * counting the callee and its arguments. the compiler only branches
+ * backwards to the start of a loop, which is reached by falling through
+ * first, so one pass in code order sees the depth at every branch target
+ * before it gets there. code following a return or an unconditional
+ * branch that nothing jumps to is dead, and keeps the depth it had.
+ */
+int chunk_max_stack(Chunk *chunk, int arity)
+{
+    int *depth_at = malloc(sizeof(int) * (chunk->size + 1));
+    if (!depth_at) {
+        fprintf(stderr, "panic: out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i <= chunk->size; i++)
+        depth_at[i] = -1;
+    int depth = arity + 1;
+    int max = depth;
+    for (size_t offset = 0; offset < chunk->size; offset += chunk_instr_size(chunk, offset)) {
+        if (depth_at[offset] > depth)
+            depth = depth_at[offset];
+        depth += stack_effect(chunk, offset);
+        if (depth > max)
+            max = depth;
+        long target = chunk_branch_target(chunk, offset);
+        if (target > (long)offset && depth_at[target] < depth)
+            depth_at[target] = depth;
+    }
+    free(depth_at);
+    return max;
+}
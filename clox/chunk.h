@@ -37,25 +37,79 @@ typedef enum {
     OP_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    OP_TAIL_CALL,
+    OP_TAIL_INVOKE,
     OP_RETURN,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_CLASS,
     OP_METHOD,
     OP_INHERIT,
+    // superinstructions, produced by the peephole pass
+    OP_GET_LOCAL2,
+    OP_INC_LOCAL,
+    OP_NOT_EQ,
+    OP_LESS_EQ,
+    OP_GREATER_EQ,
+    OP_BRANCH_NOT_LESS,
+    OP_BRANCH_NOT_GREATER,
+    OP_BRANCH_NOT_LESS_EQ,
+    OP_BRANCH_NOT_GREATER_EQ,
+    // the following are never emitted by the compiler: the vm rewrites
+    // generic instructions into them once it has seen their operand types
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUB_NUM,
+    OP_MUL_NUM,
+    OP_DIV_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GET_FIELD,
 } Opcode;
 
+#define CACHE_ENTRIES 4
+
+/*
+ * inline caches for property accesses and invokes. each instruction gets
+ * its own cache, which remembers up to CACHE_ENTRIES receiver class and
+ * shape pairs and what the lookup found for them: either the slot of a
+ * field or a method closure. for stores that add a field, next_shape is
+ * the shape the instance moves to.
+ * once a site has seen more pairs than that it's marked megamorphic and
+ * the cache is no longer consulted.
+ */
+typedef struct {
+    ObjClass *klass;
+    ObjShape *shape;
+    ObjShape *next_shape;
+    int slot; // -1 if the entry is for a method
+    Value method;
+} CacheEntry;
+
+typedef struct {
+    u8 size;
+    bool megamorphic;
+    CacheEntry entries[CACHE_ENTRIES];
+} InlineCache;
+
 typedef struct {
     u8 *code;
     int *lines;
     size_t size;
     size_t cap;
     ValueArray constants;
+    InlineCache *caches;
+    size_t cache_size;
+    size_t cache_cap;
 } Chunk;
 
 void chunk_init(Chunk *chunk);
 void chunk_write(Chunk *chunk, u8 byte, int line);
 void chunk_free(Chunk *chunk);
 size_t chunk_add_const(Chunk *chunk, Value value);
+size_t chunk_add_cache(Chunk *chunk);
+size_t chunk_instr_size(Chunk *chunk, size_t offset);
+long chunk_branch_target(Chunk *chunk, size_t offset);
+int chunk_max_stack(Chunk *chunk, int arity);
 
 #endif
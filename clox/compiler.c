@@ -9,6 +9,8 @@
 #include "memory.h"
 #include "debug.h"
 #include "list.h"
+#include "vm.h"
+#include "peephole.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "disassemble.h"
@@ -16,7 +18,7 @@
 
 #define LOCAL_COUNT     UINT8_COUNT
 #define UPVALUE_COUNT   LOCAL_COUNT
-#define GLOBAL_COUNT    UINT8_COUNT
+#define GLOBAL_COUNT    (UINT16_MAX + 1)
 #define CONSTANT_COUNT  UINT8_MAX
 #define CONSTANT_COUNT  UINT8_MAX
 
@@ -64,6 +66,7 @@ typedef struct Compiler {
     FunctionType type;
     int local_count;
     int scope_depth;
+    long last_call;     // offset of the last call or invoke, -1 if none
     struct Compiler *enclosing;
     Local locals[LOCAL_COUNT];
     Upvalue upvalues[UPVALUE_COUNT]; // count for upvalues is kept in fun
@@ -201,6 +204,7 @@ static void emit_return()
 static u8 make_constant(Value value)
 {
     size_t constant = chunk_add_const(curr_chunk(), value);
+    gc_write_barrier((Obj *)curr->fun, value);
     if (constant > CONSTANT_COUNT) {
         error("too many constants in one chunk");
         return 0;
@@ -208,6 +212,22 @@ static u8 make_constant(Value value)
     return (u8) constant;
 }
 
+static void emit_cache()
+{
+    size_t cache = chunk_add_cache(curr_chunk());
+    if (cache > UINT16_MAX)
+        error("too many property accesses in one function");
+    emit_byte((cache >> 8) & 0xFF);
+    emit_byte( cache       & 0xFF);
+}
+
+static void emit_global(u8 instr, u16 global)
+{
+    emit_byte(instr);
+    emit_byte((global >> 8) & 0xFF);
+    emit_byte( global       & 0xFF);
+}
+
 static void emit_constant(Value value)
 {
     emit_two(OP_CONSTANT, make_constant(value));
@@ -240,14 +260,17 @@ static void compiler_init(Compiler *compiler, FunctionType type)
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
+    compiler->last_call = -1;
     // we assign NULL to function first due to garbage collection
     compiler->fun = NULL;
     compiler->fun = obj_make_fun();
 
     LIST_APPEND(compiler, curr, enclosing);
 
-    if (type != TYPE_SCRIPT)
+    if (type != TYPE_SCRIPT) {
         curr->fun->name = obj_copy_string(parser.prev.start, parser.prev.len);
+        gc_write_barrier((Obj *)curr->fun, VALUE_MKOBJ(curr->fun->name));
+    }
 
     Local *local = &curr->locals[curr->local_count++];
     local->depth       = 0;
@@ -265,6 +288,10 @@ static ObjFunction *compiler_end()
 {
     emit_return();
     ObjFunction *fun = curr->fun;
+    if (!parser.had_error) {
+        peephole_optimize(curr_chunk());
+        fun->max_stack = chunk_max_stack(curr_chunk(), fun->arity);
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error)
         disassemble(curr_chunk(), fun->name != NULL ? fun->name->data : "<script>");
@@ -336,13 +363,23 @@ static void mark_initialized()
     curr->locals[curr->local_count-1].depth = curr->scope_depth;
 }
 
-static void define_var(u8 global)
+static u16 global_slot(Token *name)
+{
+    int slot = vm_global_slot(obj_copy_string(name->start, name->len));
+    if (slot >= GLOBAL_COUNT) {
+        error("too many global variables");
+        return 0;
+    }
+    return (u16) slot;
+}
+
+static void define_var(u16 global)
 {
     if (curr->scope_depth > 0) {
         mark_initialized();
         return;
     }
-    emit_two(OP_DEFINE_GLOBAL, global);
+    emit_global(OP_DEFINE_GLOBAL, global);
 }
 
 static int resolve_local(Compiler *compiler, Token *name)
@@ -405,18 +442,18 @@ static void expr();
 static void block();
 static void variable(bool can_assign);
 
-static u8 parse_var(const char *errmsg)
+static u16 parse_var(const char *errmsg)
 {
     consume(TOKEN_IDENT, errmsg);
     declare_var();
     if (curr->scope_depth > 0)
         return 0;
-    return make_ident_constant(&parser.prev);
+    return global_slot(&parser.prev);
 }
 
 static void var_decl()
 {
-    u8 global = parse_var("expected variable name");
+    u16 global = parse_var("expected variable name");
     if (match(TOKEN_EQ))
         expr();
     else
@@ -437,8 +474,8 @@ static void function(FunctionType type)
             curr->fun->arity++;
             if (curr->fun->arity > 255)
                 error_curr("can't have more than 255 parameters");
-            u8 constant = parse_var("expected parameter name");
-            define_var(constant);
+            u16 param = parse_var("expected parameter name");
+            define_var(param);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "expected ')' after function parameters");
@@ -456,7 +493,7 @@ static void function(FunctionType type)
 
 static void fun_decl()
 {
-    u8 global = parse_var("expected function name");
+    u16 global = parse_var("expected function name");
     mark_initialized();
     function(TYPE_FUNCTION);
     define_var(global);
@@ -474,16 +511,20 @@ static void named_var(Token name, bool can_assign)
         getop = OP_GET_UPVALUE;
         setop = OP_SET_UPVALUE;
     } else {
-        arg = make_ident_constant(&name);
+        arg = global_slot(&name);
         getop = OP_GET_GLOBAL;
         setop = OP_SET_GLOBAL;
     }
 
+    u8 op = getop;
     if (can_assign && match(TOKEN_EQ)) {
         expr();
-        emit_two(setop, arg);
-    } else
-        emit_two(getop, arg);
+        op = setop;
+    }
+    if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL)
+        emit_global(op, arg);
+    else
+        emit_two(op, arg);
 }
 
 static void method()
@@ -504,7 +545,7 @@ static void class_decl()
     u8 name_constant = make_ident_constant(&parser.prev);
     declare_var();
     emit_two(OP_CLASS, name_constant);
-    define_var(name_constant);
+    define_var(curr->scope_depth > 0 ? 0 : global_slot(&class_name));
 
     ClassCompiler compiler;
     compiler.has_super = false;
@@ -515,6 +556,7 @@ static void class_decl()
         variable(false);
         if (ident_equal(&class_name, &parser.prev))
             error("a class can't inherit from itself");
+        compiler.has_super = true;
         begin_scope();
         add_local(synthetic_token("super"));
         define_var(0);
@@ -648,6 +690,17 @@ static void return_stmt()
             error("can't return value from constructor");
         expr();
         consume(TOKEN_SEMICOLON, "expected semicolon after return expression");
+        // a call whose result is returned right away can reuse the frame.
+        // the return stays behind it for what the call doesn't replace
+        // (natives, classes without init) and for branches landing there.
+        Chunk *chunk = curr_chunk();
+        if (curr->last_call >= 0) {
+            u8 *code = &chunk->code[curr->last_call];
+            if (code[0] == OP_CALL && curr->last_call + 2 == (long)chunk->size)
+                code[0] = OP_TAIL_CALL;
+            else if (code[0] == OP_INVOKE && curr->last_call + 5 == (long)chunk->size)
+                code[0] = OP_TAIL_INVOKE;
+        }
         emit_byte(OP_RETURN);
     }
 }
@@ -758,6 +811,7 @@ static u8 arglist()
 static void call(bool can_assign)
 {
     u8 argc = arglist();
+    curr->last_call = curr_chunk()->size;
     emit_two(OP_CALL, argc);
 }
 
@@ -768,12 +822,17 @@ static void dot(bool can_assign)
     if (can_assign && match(TOKEN_EQ)) {
         expr();
         emit_two(OP_SET_PROPERTY, name);
+        emit_cache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         u8 argc = arglist();
+        curr->last_call = curr_chunk()->size;
         emit_two(OP_INVOKE, name);
         emit_byte(argc);
-    } else
+        emit_cache();
+    } else {
         emit_two(OP_GET_PROPERTY, name);
+        emit_cache();
+    }
 }
 
 static void unary(bool can_assign)
@@ -0,0 +1,118 @@
+#include "deque.h"
+
+#include <stdlib.h>
+
+// follows "correct and efficient work-stealing for weak memory models"
+
+#define DEQUE_INITIAL_CAP 1024
+
+static DequeArray *new_array(long cap)
+{
+    DequeArray *array = malloc(sizeof(DequeArray) + cap * sizeof(Obj *));
+    if (!array)
+        abort();
+    array->retired = NULL;
+    array->cap = cap;
+    return array;
+}
+
+void deque_init(Deque *deque)
+{
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, new_array(DEQUE_INITIAL_CAP));
+}
+
+static void free_retired(DequeArray *array)
+{
+    while (array != NULL) {
+        DequeArray *next = array->retired;
+        free(array);
+        array = next;
+    }
+}
+
+void deque_free(Deque *deque)
+{
+    free_retired(atomic_load_explicit(&deque->array, memory_order_relaxed));
+}
+
+// to be called when no thread can be stealing
+void deque_reset(Deque *deque)
+{
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    free_retired(array->retired);
+    array->retired = NULL;
+    atomic_store_explicit(&deque->top, 0, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, 0, memory_order_relaxed);
+}
+
+static DequeArray *grow(Deque *deque, DequeArray *array, long top, long bottom)
+{
+    DequeArray *bigger = new_array(array->cap * 2);
+    for (long i = top; i < bottom; i++) {
+        Obj *obj = atomic_load_explicit(&array->items[i & (array->cap - 1)], memory_order_relaxed);
+        atomic_store_explicit(&bigger->items[i & (bigger->cap - 1)], obj, memory_order_relaxed);
+    }
+    bigger->retired = array;
+    atomic_store_explicit(&deque->array, bigger, memory_order_release);
+    return bigger;
+}
+
+void deque_push(Deque *deque, Obj *obj)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top    = atomic_load_explicit(&deque->top, memory_order_acquire);
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top > array->cap - 1)
+        array = grow(deque, array, top, bottom);
+    atomic_store_explicit(&array->items[bottom & (array->cap - 1)], obj, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+Obj *deque_pop(Deque *deque)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Obj *obj = atomic_load_explicit(&array->items[bottom & (array->cap - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // the last one: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            obj = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return obj;
+}
+
+// returns NULL when the deque is empty or another thread won the race
+Obj *deque_steal(Deque *deque)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    Obj *obj = atomic_load_explicit(&array->items[top & (array->cap - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return obj;
+}
+
+bool deque_is_empty(Deque *deque)
+{
+    long top    = atomic_load_explicit(&deque->top, memory_order_acquire);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    return top >= bottom;
+}
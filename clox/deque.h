@@ -0,0 +1,35 @@
+#ifndef DEQUE_H_INCLUDED
+#define DEQUE_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "object.h"
+
+/*
+ * a chase-lev work-stealing deque of objects, used by parallel marking.
+ * only its owner thread pushes and pops, at the bottom; other threads
+ * steal from the top. arrays outgrown while thieves might still be
+ * reading them are kept until deque_reset().
+ */
+
+typedef struct DequeArray {
+    struct DequeArray *retired;
+    long cap;
+    _Atomic(Obj *) items[];
+} DequeArray;
+
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(DequeArray *) array;
+} Deque;
+
+void deque_init(Deque *deque);
+void deque_free(Deque *deque);
+void deque_reset(Deque *deque);
+void deque_push(Deque *deque, Obj *obj);
+Obj *deque_pop(Deque *deque);
+Obj *deque_steal(Deque *deque);
+bool deque_is_empty(Deque *deque);
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 static size_t simple_instr(const char *name, size_t offset)
 {
@@ -26,9 +27,34 @@ static size_t byte_instr(const char *name, Chunk *chunk, size_t offset)
     return offset + 2;
 }
 
+static size_t byte2_instr(const char *name, Chunk *chunk, size_t offset)
+{
+    printf("%s %03d %03d", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static size_t inc_instr(const char *name, Chunk *chunk, size_t offset)
+{
+    u8 slot  = chunk->code[offset + 1];
+    u8 index = chunk->code[offset + 2];
+    printf("%s %03d %03d '", name, slot, index);
+    value_print(chunk->constants.values[index]);
+    printf("'");
+    return offset + 3;
+}
+
+static size_t global_instr(const char *name, Chunk *chunk, size_t offset)
+{
+    u16 slot = TOU16(chunk->code[offset + 2], chunk->code[offset + 1]);
+    printf("%s %05d '", name, slot);
+    value_print(vm.global_names.values[slot]);
+    printf("'");
+    return offset + 3;
+}
+
 static size_t jump_instr(const char *name, int sign, Chunk *chunk, size_t offset)
 {
-    u16 branch = TOU16(chunk->code[offset + 1], chunk->code[offset + 2]);
+    u16 branch = TOU16(chunk->code[offset + 2], chunk->code[offset + 1]);
     printf("%s %ld -> %ld", name, offset, offset + 3 + sign * branch);
     return offset + 3;
 }
@@ -61,6 +87,22 @@ static size_t invoke_instr(const char *name, Chunk *chunk, size_t offset)
     return offset + 3;
 }
 
+static size_t property_instr(const char *name, Chunk *chunk, size_t offset)
+{
+    u16 cache = TOU16(chunk->code[offset + 3], chunk->code[offset + 2]);
+    size_t next = const_instr(name, chunk, offset);
+    printf(" ic %d", cache);
+    return next + 2;
+}
+
+static size_t invoke_cache_instr(const char *name, Chunk *chunk, size_t offset)
+{
+    u16 cache = TOU16(chunk->code[offset + 4], chunk->code[offset + 3]);
+    size_t next = invoke_instr(name, chunk, offset);
+    printf(" ic %d", cache);
+    return next + 2;
+}
+
 void disassemble(Chunk *chunk, const char *name)
 {
     printf("=== %s ===\n", name);
@@ -86,15 +128,15 @@ size_t disassemble_opcode(Chunk *chunk, size_t offset)
     case OP_TRUE:           return simple_instr("ldt", offset);
     case OP_FALSE:          return simple_instr("ldf", offset);
     case OP_POP:            return simple_instr("pop", offset);
-    case OP_DEFINE_GLOBAL:  return const_instr("dfg", chunk, offset);
-    case OP_GET_GLOBAL:     return const_instr("ldg", chunk, offset);
-    case OP_SET_GLOBAL:     return const_instr("stg", chunk, offset);
+    case OP_DEFINE_GLOBAL:  return global_instr("dfg", chunk, offset);
+    case OP_GET_GLOBAL:     return global_instr("ldg", chunk, offset);
+    case OP_SET_GLOBAL:     return global_instr("stg", chunk, offset);
     case OP_GET_LOCAL:      return byte_instr("ldl", chunk, offset);
     case OP_SET_LOCAL:      return byte_instr("stl", chunk, offset);
     case OP_GET_UPVALUE:    return byte_instr("ldu", chunk, offset);
     case OP_SET_UPVALUE:    return byte_instr("stu", chunk, offset);
-    case OP_GET_PROPERTY:   return const_instr("ldp", chunk, offset);
-    case OP_SET_PROPERTY:   return const_instr("stp", chunk, offset);
+    case OP_GET_PROPERTY:   return property_instr("ldp", chunk, offset);
+    case OP_SET_PROPERTY:   return property_instr("stp", chunk, offset);
     case OP_GET_SUPER:      return const_instr("lds", chunk, offset);
     case OP_EQ:             return simple_instr("cme", offset);
     case OP_GREATER:        return simple_instr("cmg", offset);
@@ -109,13 +151,33 @@ size_t disassemble_opcode(Chunk *chunk, size_t offset)
     case OP_BRANCH_FALSE:   return jump_instr("bfl",  1, chunk, offset);
     case OP_BRANCH_BACK:    return jump_instr("bbw", -1, chunk, offset);
     case OP_CALL:           return byte_instr("cal", chunk, offset);
-    case OP_INVOKE:         return invoke_instr("ivk", chunk, offset);
+    case OP_INVOKE:         return invoke_cache_instr("ivk", chunk, offset);
     case OP_SUPER_INVOKE:   return invoke_instr("svk", chunk, offset);
+    case OP_TAIL_CALL:      return byte_instr("tcal", chunk, offset);
+    case OP_TAIL_INVOKE:    return invoke_cache_instr("tivk", chunk, offset);
     case OP_RETURN:         return simple_instr("ret", offset);
     case OP_CLOSURE:        return closure_instr("clo", chunk, offset);
     case OP_CLOSE_UPVALUE:  return simple_instr("clu", offset);
     case OP_CLASS:          return const_instr("dfc", chunk, offset);
     case OP_METHOD:         return const_instr("dfm", chunk, offset);
+    case OP_INHERIT:        return simple_instr("inh", offset);
+    case OP_GET_LOCAL2:     return byte2_instr("ldl2", chunk, offset);
+    case OP_INC_LOCAL:      return inc_instr("incl", chunk, offset);
+    case OP_NOT_EQ:         return simple_instr("cmne", offset);
+    case OP_LESS_EQ:        return simple_instr("cmle", offset);
+    case OP_GREATER_EQ:     return simple_instr("cmge", offset);
+    case OP_BRANCH_NOT_LESS:       return jump_instr("bnl",  1, chunk, offset);
+    case OP_BRANCH_NOT_GREATER:    return jump_instr("bng",  1, chunk, offset);
+    case OP_BRANCH_NOT_LESS_EQ:    return jump_instr("bnle", 1, chunk, offset);
+    case OP_BRANCH_NOT_GREATER_EQ: return jump_instr("bnge", 1, chunk, offset);
+    case OP_ADD_NUM:        return simple_instr("addn", offset);
+    case OP_ADD_STR:        return simple_instr("adds", offset);
+    case OP_SUB_NUM:        return simple_instr("subn", offset);
+    case OP_MUL_NUM:        return simple_instr("muln", offset);
+    case OP_DIV_NUM:        return simple_instr("divn", offset);
+    case OP_GREATER_NUM:    return simple_instr("cmgn", offset);
+    case OP_LESS_NUM:       return simple_instr("cmln", offset);
+    case OP_GET_FIELD:      return property_instr("ldpf", chunk, offset);
     default:
         printf("[unknown] [%d]", instr);
         return offset + 1;
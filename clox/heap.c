@@ -0,0 +1,373 @@
+#include "heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "object.h"
+#include "vm.h"
+
+#define CELLS_OFFSET    ((sizeof(Page) + HEAP_GRANULE - 1) & ~(size_t)(HEAP_GRANULE - 1))
+
+static Page *pages[HEAP_CLASSES];       // every page of a size class
+static Page *alloc_pages[HEAP_CLASSES]; // where allocation looks for free cells
+static Large *large_objs = NULL;
+static size_t swept_bytes = 0;          // freed since heap_begin_sweep()
+static Page *evacuated = NULL;          // emptied by heap_compact()
+
+/* sweeping goes through the size classes in order and finishes with the
+ * large objects, at sweep_class == HEAP_CLASSES. */
+static int sweep_class = 0;
+static Page *sweep_page = NULL;
+static Large *sweep_large = NULL;
+
+static void set_bit(u64 *bitmap, size_t bit) { bitmap[bit / 64] |= (u64)1 << (bit % 64); }
+
+// links a new page in after prev, or first when prev is NULL
+static Page *new_page(size_t class, Page *prev)
+{
+    Page *page = aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+    if (!page)
+        abort();
+    memset(page, 0, sizeof(Page));
+    page->cell_size = (class + 1) * HEAP_GRANULE;
+
+    // link the cells backwards, so that they're handed out in address order
+    u8 *cells = (u8 *)page + CELLS_OFFSET;
+    size_t count = (HEAP_PAGE_SIZE - CELLS_OFFSET) / page->cell_size;
+    for (size_t i = count; i-- > 0; ) {
+        void **cell = (void **)(cells + i * page->cell_size);
+        *cell = page->free;
+        page->free = cell;
+    }
+
+    Page **link = prev != NULL ? &prev->next : &pages[class];
+    page->prev = prev;
+    page->next = *link;
+    if (*link != NULL)
+        (*link)->prev = page;
+    *link = page;
+    return page;
+}
+
+static void unlink_page(Page *page)
+{
+    size_t class = page->cell_size / HEAP_GRANULE - 1;
+    if (alloc_pages[class] == page)
+        alloc_pages[class] = page->next;
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        pages[class] = page->next;
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+}
+
+static void free_page(Page *page)
+{
+    unlink_page(page);
+    free(page);
+}
+
+static Obj *alloc_large(size_t size)
+{
+    Large *large = malloc(sizeof(Large) + size);
+    if (!large)
+        abort();
+    large->prev    = NULL;
+    large->next    = large_objs;
+    large->size    = size;
+    large->unswept = false;
+    large->marks   = 0;
+    if (large_objs != NULL)
+        large_objs->prev = large;
+    large_objs = large;
+
+    Obj *obj = (Obj *)large->data;
+    obj->large = true;
+    return obj;
+}
+
+static void free_large(Large *large)
+{
+    if (large->prev != NULL)
+        large->prev->next = large->next;
+    else
+        large_objs = large->next;
+    if (large->next != NULL)
+        large->next->prev = large->prev;
+    free(large);
+}
+
+static void free_obj(Obj *obj)
+{
+    size_t size = obj_size(obj);
+    vm.bytes_allocated -= size;
+    swept_bytes += size;
+    obj_free(obj);
+}
+
+/* the dead cells of a bitmap word are collected first and then freed in
+ * one go, fetching the next one ahead, with a single update of
+ * vm.bytes_allocated for the page. */
+static void sweep_page_cells(Page *page)
+{
+    u8 *base = (u8 *)page;
+    Obj *batch[64];
+    size_t freed = 0;
+    for (size_t i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        u64 dead = page->used[i] & ~page->marks[i];
+        page->used[i] &= page->marks[i];
+        page->marks[i] = 0;
+        int count = 0;
+        while (dead != 0) {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            batch[count++] = (Obj *)(base + (i * 64 + bit) * HEAP_GRANULE);
+        }
+        for (int j = 0; j < count; j++) {
+            Obj *obj = batch[j];
+            if (j + 1 < count)
+                __builtin_prefetch(batch[j + 1]);
+            freed += obj_size(obj);
+            obj_free(obj);
+            *(void **)obj = page->free;
+            page->free = obj;
+        }
+        page->live -= count;
+    }
+    vm.bytes_allocated -= freed;
+    swept_bytes += freed;
+    page->unswept = false;
+}
+
+void *heap_alloc(size_t size)
+{
+    if (size > HEAP_MAX_CELL)
+        return alloc_large(size);
+
+    size_t class = (size - 1) / HEAP_GRANULE;
+    /* the pages behind the cursor were full when it passed them. pages
+     * the sweep hasn't reached yet are swept here, on demand. */
+    Page *page = alloc_pages[class], *last = NULL;
+    while (page != NULL) {
+        if (page->unswept)
+            sweep_page_cells(page);
+        if (page->free != NULL)
+            break;
+        last = page;
+        page = page->next;
+    }
+    if (page == NULL)
+        page = new_page(class, last);
+    alloc_pages[class] = page;
+
+    Obj *obj = page->free;
+    page->free = *(void **)obj;
+    page->live++;
+    set_bit(page->used, heap_bit(obj));
+    obj->large = false;
+    return obj;
+}
+
+/* returns the share of the heap's object bytes that got marked, which
+ * the bitmaps tell without looking at the objects. */
+double heap_begin_sweep()
+{
+    size_t marked = 0, used = 0;
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        for (Page *page = pages[i]; page != NULL; page = page->next) {
+            page->unswept = true;
+            size_t count = 0;
+            for (size_t j = 0; j < HEAP_BITMAP_WORDS; j++)
+                count += __builtin_popcountll(page->marks[j]);
+            marked += count * page->cell_size;
+            used   += page->live * page->cell_size;
+        }
+    }
+    for (Large *large = large_objs; large != NULL; large = large->next) {
+        large->unswept = true;
+        if (large->marks)
+            marked += large->size;
+        used += large->size;
+    }
+    sweep_class = 0;
+    sweep_page  = pages[0];
+    sweep_large = large_objs;
+    swept_bytes = 0;
+    memcpy(alloc_pages, pages, sizeof(pages));
+    return used > 0 ? (double)marked / used : 1.0;
+}
+
+/* sweeps about budget bytes worth of pages, returns whether it's done.
+ * pages already swept by heap_alloc() are skipped, like the ones added
+ * after heap_begin_sweep(). pages that end up empty are freed. */
+bool heap_sweep(long budget)
+{
+    while (sweep_class < HEAP_CLASSES && budget > 0) {
+        if (sweep_page == NULL) {
+            if (++sweep_class < HEAP_CLASSES)
+                sweep_page = pages[sweep_class];
+            continue;
+        }
+        Page *page = sweep_page;
+        sweep_page = page->next;
+        if (!page->unswept)
+            continue;
+        sweep_page_cells(page);
+        if (page->live == 0)
+            free_page(page);
+        budget -= HEAP_PAGE_SIZE;
+    }
+    while (sweep_large != NULL && budget > 0) {
+        Large *large = sweep_large;
+        sweep_large = large->next;
+        if (!large->unswept)
+            continue;
+        large->unswept = false;
+        budget -= large->size;
+        if (large->marks) {
+            large->marks = 0;
+        } else {
+            free_obj((Obj *)large->data);
+            free_large(large);
+        }
+    }
+    return sweep_class == HEAP_CLASSES && sweep_large == NULL;
+}
+
+// returns how many bytes of objects the sweep freed
+size_t heap_finish_sweep()
+{
+    // cells freed behind the allocation cursors can be used again
+    memcpy(alloc_pages, pages, sizeof(pages));
+    return swept_bytes;
+}
+
+static size_t cells_per_page(size_t cell_size)
+{
+    return (HEAP_PAGE_SIZE - CELLS_OFFSET) / cell_size;
+}
+
+// pages needed to hold the live objects of a class
+static size_t pages_needed(int class, size_t *count)
+{
+    size_t live = 0;
+    *count = 0;
+    for (Page *page = pages[class]; page != NULL; page = page->next) {
+        (*count)++;
+        live += page->live;
+    }
+    size_t per_page = cells_per_page((class + 1) * HEAP_GRANULE);
+    return (live + per_page - 1) / per_page;
+}
+
+// bytes in pages, and how many of them heap_compact() would give back
+void heap_usage(size_t *capacity, size_t *reclaimable)
+{
+    *capacity = *reclaimable = 0;
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        size_t count;
+        size_t needed = pages_needed(i, &count);
+        *capacity    += count * HEAP_PAGE_SIZE;
+        *reclaimable += (count - needed) * HEAP_PAGE_SIZE;
+    }
+}
+
+static int by_live_desc(const void *a, const void *b)
+{
+    size_t x = (*(Page *const *)a)->live, y = (*(Page *const *)b)->live;
+    return (x < y) - (x > y);
+}
+
+#define FOR_EACH_CELL(page, obj)                                            \
+    for (size_t i_ = 0; i_ < HEAP_BITMAP_WORDS; i_++)                       \
+        for (u64 bits_ = (page)->used[i_]; bits_ != 0; bits_ &= bits_ - 1)  \
+            for (Obj *obj = (Obj *)((u8 *)(page) + (i_ * 64 + __builtin_ctzll(bits_)) * HEAP_GRANULE); \
+                 obj != NULL; obj = NULL)
+
+/* the live objects of a class would fit in fewer pages than it has: the
+ * fullest pages are kept and the objects of the others are moved into
+ * their free cells. */
+static void compact_class(int class, void (*moved)(Obj *from, Obj *to))
+{
+    size_t count;
+    size_t needed = pages_needed(class, &count);
+    if (needed >= count)
+        return;
+
+    Page **sorted = malloc(sizeof(Page *) * count);
+    if (!sorted)
+        abort();
+    size_t n = 0;
+    for (Page *page = pages[class]; page != NULL; page = page->next)
+        sorted[n++] = page;
+    qsort(sorted, count, sizeof(Page *), by_live_desc);
+
+    size_t dest = 0;
+    for (size_t i = needed; i < count; i++) {
+        Page *page = sorted[i];
+        FOR_EACH_CELL(page, obj) {
+            while (sorted[dest]->free == NULL)
+                dest++;
+            Page *to_page = sorted[dest];
+            Obj *to = to_page->free;
+            to_page->free = *(void **)to;
+            to_page->live++;
+            set_bit(to_page->used, heap_bit(to));
+            memcpy(to, obj, page->cell_size);
+            moved(obj, to);
+        }
+        unlink_page(page);
+        page->next = evacuated;
+        evacuated = page;
+    }
+    free(sorted);
+}
+
+/* moves objects out of sparse pages, calling moved() for each of them.
+ * the pages they leave stay readable until heap_release_evacuated(), so
+ * references to them can still be fixed up. needs a swept heap. */
+void heap_compact(void (*moved)(Obj *from, Obj *to))
+{
+    for (int i = 0; i < HEAP_CLASSES; i++)
+        compact_class(i, moved);
+    memcpy(alloc_pages, pages, sizeof(pages));
+}
+
+// calls visit() on every object of the heap
+void heap_visit(void (*visit)(Obj *obj))
+{
+    for (int i = 0; i < HEAP_CLASSES; i++)
+        for (Page *page = pages[i]; page != NULL; page = page->next)
+            FOR_EACH_CELL(page, obj)
+                visit(obj);
+    for (Large *large = large_objs; large != NULL; large = large->next)
+        visit((Obj *)large->data);
+}
+
+void heap_release_evacuated()
+{
+    while (evacuated != NULL) {
+        Page *next = evacuated->next;
+        free(evacuated);
+        evacuated = next;
+    }
+}
+
+void heap_free_all()
+{
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        while (pages[i] != NULL) {
+            Page *page = pages[i];
+            memset(page->marks, 0, sizeof(page->marks));
+            sweep_page_cells(page);
+            free_page(page);
+        }
+    }
+    while (large_objs != NULL) {
+        free_obj((Obj *)large_objs->data);
+        free_large(large_objs);
+    }
+    sweep_page  = NULL;
+    sweep_large = NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef HEAP_H_INCLUDED
+#define HEAP_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "uint.h"
+#include "object.h"
+
+/*
+ * the old space. objects of up to HEAP_MAX_CELL bytes live in pages of
+ * HEAP_PAGE_SIZE bytes, aligned to their size, each split into cells of
+ * a single size class. instead of flags in the object headers a page
+ * keeps two bitmaps, with one bit for every HEAP_GRANULE bytes: the cells
+ * in use and the cells marked by the collector. bigger objects get an
+ * allocation of their own with a Large header in front.
+ */
+
+#define HEAP_PAGE_SIZE      (64 * 1024)
+#define HEAP_GRANULE        16
+#define HEAP_MAX_CELL       512
+#define HEAP_CLASSES        (HEAP_MAX_CELL / HEAP_GRANULE)
+#define HEAP_BITMAP_WORDS   (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+
+typedef struct Page {
+    struct Page *prev;
+    struct Page *next;
+    void *free;         // free cells, linked through their first word
+    size_t cell_size;
+    size_t live;        // cells in use
+    bool unswept;       // marked during the last cycle, not swept yet
+    u64 used[HEAP_BITMAP_WORDS];
+    u64 marks[HEAP_BITMAP_WORDS];
+} Page;
+
+typedef struct Large {
+    struct Large *prev;
+    struct Large *next;
+    size_t size;
+    bool unswept;
+    u64 marks;          // a single bit
+    _Alignas(HEAP_GRANULE) u8 data[];
+} Large;
+
+static inline Page *heap_page(Obj *obj)
+{
+    return (Page *)((uintptr_t)obj & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline Large *heap_large(Obj *obj)
+{
+    return (Large *)((u8 *)obj - offsetof(Large, data));
+}
+
+static inline size_t heap_bit(Obj *obj)
+{
+    return ((u8 *)obj - (u8 *)heap_page(obj)) / HEAP_GRANULE;
+}
+
+void *heap_alloc(size_t size);
+double heap_begin_sweep(void);
+bool heap_sweep(long budget);
+size_t heap_finish_sweep(void);
+void heap_usage(size_t *capacity, size_t *reclaimable);
+void heap_compact(void (*moved)(Obj *from, Obj *to));
+void heap_visit(void (*visit)(Obj *obj));
+void heap_release_evacuated(void);
+void heap_free_all(void);
+
+#endif
@@ -0,0 +1,800 @@
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS
+
+#include "jit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "uint.h"
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT_ENABLED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * the code of a function starts with a prologue, which saves the
+ * callee-saved registers, loads the ones below and jumps to the
+ * instruction it was asked for, a stub that reloads them for the code of
+ * another function after a call or a return, and an epilogue, which every
+ * exit from the function goes through. the templates follow, one after the other in
+ * bytecode order, and the slow paths they branch to come last.
+ * while the code runs:
+ *     rbx  the frame
+ *     r12  frame->slots
+ *     r13  the top of the stack, stored back to vm.sp around calls into C
+ *     r14  &vm
+ *     r15  the bytecode, for setting frame->ip
+ *     rbp  QNAN, the bits every value that isn't a number has
+ * the values themselves only go through rax, rcx, rdx, xmm0 and xmm1, and
+ * never outlive their instruction.
+ */
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+enum { XMM0, XMM1 };
+
+// condition codes, as the low nibble of jcc and setcc
+enum {
+    CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_S = 0x8,
+    CC_NP = 0xb,
+};
+
+#define NO_ENTRY UINT32_MAX
+
+struct JitCode {
+    u8 *mem;
+    size_t size;        // of the mapping
+    u32 *entries;       // by bytecode offset, where its instruction starts in mem
+};
+
+typedef struct {
+    u32 at;         // of the rel32 to fill in
+    u32 target;     // a bytecode offset
+} Patch;
+
+typedef struct {
+    u32 at;
+    u32 offset;     // of the instruction whose slow path it jumps to
+} SlowJump;
+
+typedef struct {
+    Chunk *chunk;
+    u8 *code;
+    size_t size;
+    size_t cap;
+    u32 *entries;
+    u32 exit;       // the epilogue
+    u32 switch_frame;
+    Patch *patches;
+    size_t patch_size;
+    size_t patch_cap;
+    SlowJump *slow;
+    size_t slow_size;
+    size_t slow_cap;
+} Asm;
+
+static void *grow(void *arr, size_t *cap, size_t elem)
+{
+    *cap = *cap == 0 ? 64 : *cap * 2;
+    arr = realloc(arr, *cap * elem);
+    if (!arr) {
+        fprintf(stderr, "panic: out of memory compiling a function\n");
+        exit(1);
+    }
+    return arr;
+}
+
+static void emit8(Asm *a, u8 byte)
+{
+    if (a->size == a->cap)
+        a->code = grow(a->code, &a->cap, 1);
+    a->code[a->size++] = byte;
+}
+
+static void emit32(Asm *a, u32 word)
+{
+    for (int i = 0; i < 4; i++)
+        emit8(a, word >> (i * 8));
+}
+
+static void emit64(Asm *a, u64 word)
+{
+    emit32(a, (u32)word);
+    emit32(a, (u32)(word >> 32));
+}
+
+static void patch32(Asm *a, u32 at, u32 target)
+{
+    u32 rel = target - (at + 4);
+    memcpy(&a->code[at], &rel, 4);
+}
+
+/* prefix is a mandatory 0x66 or 0xf2 of the sse instructions, or 0. the
+ * opcode is one byte, or two starting with 0x0f. */
+static void emit_op(Asm *a, u8 prefix, bool wide, u32 op, int reg, int rm)
+{
+    if (prefix != 0)
+        emit8(a, prefix);
+    u8 rex = 0x40 | wide << 3 | (reg & 8) >> 1 | (rm & 8) >> 3;
+    if (rex != 0x40)
+        emit8(a, rex);
+    if (op > 0xff)
+        emit8(a, op >> 8);
+    emit8(a, op);
+}
+
+// op reg, rm with both in registers
+static void emit_rr(Asm *a, u8 prefix, bool wide, u32 op, int reg, int rm)
+{
+    emit_op(a, prefix, wide, op, reg, rm);
+    emit8(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op reg, [base + disp]. the displacement is never left out, which also
+ * keeps rbp and r13 from being read as rip-relative. */
+static void emit_rm(Asm *a, u8 prefix, bool wide, u32 op, int reg, int base, i32 disp)
+{
+    emit_op(a, prefix, wide, op, reg, base);
+    bool short_disp = disp >= -128 && disp <= 127;
+    emit8(a, (short_disp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP)
+        emit8(a, 0x24);     // sib, for a base of rsp or r12
+    if (short_disp)
+        emit8(a, (u8)disp);
+    else
+        emit32(a, (u32)disp);
+}
+
+// op reg, [base + index * (1 << scale) + disp8], on the first eight registers
+static void emit_sib(Asm *a, bool wide, u32 op, int reg, int base, int index, int scale, i8 disp)
+{
+    emit_op(a, 0, wide, op, reg, 0);
+    emit8(a, 0x44 | reg << 3);
+    emit8(a, scale << 6 | index << 3 | base);
+    emit8(a, (u8)disp);
+}
+
+static void load(Asm *a, int dst, int base, i32 disp)   { emit_rm(a, 0, true, 0x8b, dst, base, disp); }
+static void store(Asm *a, int base, i32 disp, int src)  { emit_rm(a, 0, true, 0x89, src, base, disp); }
+static void lea(Asm *a, int dst, int base, i32 disp)    { emit_rm(a, 0, true, 0x8d, dst, base, disp); }
+
+static void mov_imm(Asm *a, int dst, u64 imm)
+{
+    if (imm <= UINT32_MAX) {
+        emit_op(a, 0, false, 0xb8 + (dst & 7), 0, dst);
+        emit32(a, (u32)imm);
+    } else {
+        emit_op(a, 0, true, 0xb8 + (dst & 7), 0, dst);
+        emit64(a, imm);
+    }
+}
+
+static void push(Asm *a, int reg) { emit_op(a, 0, false, 0x50 + (reg & 7), 0, reg); }
+static void pop(Asm *a, int reg)  { emit_op(a, 0, false, 0x58 + (reg & 7), 0, reg); }
+
+// jcc or jmp with a rel32 to fill in later, whose position is returned
+static u32 jump(Asm *a, int cc)
+{
+    if (cc < 0)
+        emit8(a, 0xe9);
+    else {
+        emit8(a, 0x0f);
+        emit8(a, 0x80 | cc);
+    }
+    emit32(a, 0);
+    return a->size - 4;
+}
+
+static void jump_to(Asm *a, int cc, u32 target)
+{
+    patch32(a, jump(a, cc), target);
+}
+
+// jumps to the instruction at a bytecode offset
+static void branch(Asm *a, int cc, u32 target)
+{
+    if (a->patch_size == a->patch_cap)
+        a->patches = grow(a->patches, &a->patch_cap, sizeof(Patch));
+    a->patches[a->patch_size++] = (Patch){ jump(a, cc), target };
+}
+
+// jumps to the slow path of the instruction at offset
+static void slow_path(Asm *a, int cc, u32 offset)
+{
+    if (a->slow_size == a->slow_cap)
+        a->slow = grow(a->slow, &a->slow_cap, sizeof(SlowJump));
+    a->slow[a->slow_size++] = (SlowJump){ jump(a, cc), offset };
+}
+
+#define SP_OFFSET       ((i32)offsetof(VM, sp))
+#define GLOBALS_OFFSET  ((i32)(offsetof(VM, global_values) + offsetof(ValueArray, values)))
+#define PENDING_OFFSET  ((i32)offsetof(VM, gc_pending))
+
+// the safepoint check reads vm.gc_pending as a dword
+_Static_assert(sizeof(sig_atomic_t) == 4, "vm.gc_pending isn't 32 bits");
+
+// pushes rax
+static void push_value(Asm *a)
+{
+    store(a, R13, 0, RAX);
+    lea(a, R13, R13, 8);
+}
+
+// a constant that isn't a number is one of QNAN's neighbours
+static void lea_tag(Asm *a, int dst, int tag)
+{
+    lea(a, dst, RBP, tag);
+}
+
+// to the slow path unless reg holds a number
+static void check_num(Asm *a, int reg, u32 offset)
+{
+    emit_rr(a, 0, true, 0x89, reg, RDX);        // mov rdx, reg
+    emit_rr(a, 0, true, 0x21, RBP, RDX);        // and rdx, rbp
+    emit_rr(a, 0, true, 0x39, RBP, RDX);        // cmp rdx, rbp
+    slow_path(a, CC_E, offset);
+}
+
+// the two operands of a binary instruction, a into rax and b into rcx
+static void load_operands(Asm *a, u32 offset)
+{
+    load(a, RAX, R13, -16);
+    load(a, RCX, R13, -8);
+    check_num(a, RAX, offset);
+    check_num(a, RCX, offset);
+    emit_rr(a, 0x66, true, 0x0f6e, XMM0, RAX);  // movq xmm0, rax
+    emit_rr(a, 0x66, true, 0x0f6e, XMM1, RCX);  // movq xmm1, rcx
+}
+
+// replaces the operands with rax
+static void store_result(Asm *a)
+{
+    store(a, R13, -16, RAX);
+    lea(a, R13, R13, -8);
+}
+
+// the boolean for the condition in al
+static void make_bool(Asm *a)
+{
+    emit_rr(a, 0, false, 0x0fb6, RAX, RAX);     // movzx eax, al
+    lea_tag(a, RCX, TAG_FALSE);
+    emit_rr(a, 0, true, 0x01, RCX, RAX);        // add rax, rcx
+}
+
+static void setcc(Asm *a, int cc, int reg)
+{
+    emit_rr(a, 0, false, 0x0f90 | cc, 0, reg);
+}
+
+static void arith(Asm *a, u32 sse_op, u32 offset)
+{
+    load_operands(a, offset);
+    emit_rr(a, 0xf2, false, sse_op, XMM0, XMM1);
+    emit_rr(a, 0x66, true, 0x0f7e, XMM0, RAX);  // movq rax, xmm0
+    store_result(a);
+}
+
+// ucomisd x, y sets the flags as if for x - y
+static void compare(Asm *a, int x, int y, int cc, u32 offset)
+{
+    load_operands(a, offset);
+    emit_rr(a, 0x66, false, 0x0f2e, x, y);
+    setcc(a, cc, RAX);
+    make_bool(a);
+    store_result(a);
+}
+
+static void compare_branch(Asm *a, int x, int y, int cc, u32 offset, u32 target)
+{
+    load_operands(a, offset);
+    emit_rr(a, 0x66, false, 0x0f2e, x, y);
+    lea(a, R13, R13, -16);      // leaves the flags alone
+    branch(a, cc, target);
+}
+
+/* numbers are equal as doubles, anything else if the bits are. only two
+ * objects can still be equal strings, which is left to the slow path. */
+static void equal(Asm *a, bool negate, u32 offset)
+{
+    load(a, RAX, R13, -16);
+    load(a, RCX, R13, -8);
+    lea_tag(a, RDX, 0);
+    emit_rr(a, 0, true, 0x21, RAX, RDX);        // and rdx, rax
+    emit_rr(a, 0, true, 0x39, RBP, RDX);        // cmp rdx, rbp
+    u32 not_num = jump(a, CC_E);
+    lea_tag(a, RDX, 0);
+    emit_rr(a, 0, true, 0x21, RCX, RDX);
+    emit_rr(a, 0, true, 0x39, RBP, RDX);
+    u32 not_num2 = jump(a, CC_E);
+    emit_rr(a, 0x66, true, 0x0f6e, XMM0, RAX);
+    emit_rr(a, 0x66, true, 0x0f6e, XMM1, RCX);
+    emit_rr(a, 0x66, false, 0x0f2e, XMM0, XMM1);
+    setcc(a, CC_E, RAX);
+    setcc(a, CC_NP, RCX);
+    emit_rr(a, 0, false, 0x20, RCX, RAX);       // and al, cl
+    u32 done = jump(a, -1);
+
+    patch32(a, not_num, a->size);
+    patch32(a, not_num2, a->size);
+    emit_rr(a, 0, true, 0x39, RCX, RAX);        // cmp rax, rcx
+    setcc(a, CC_E, RAX);
+    u32 same = jump(a, CC_E);
+    emit_rr(a, 0, true, 0x89, RAX, RDX);        // mov rdx, rax
+    emit_rr(a, 0, true, 0x21, RCX, RDX);        // and rdx, rcx
+    emit_rr(a, 0, true, 0xc1, 5, RDX);          // shr rdx, 50
+    emit8(a, 50);
+    emit_rr(a, 0, false, 0x81, 7, RDX);         // cmp edx, 0x3fff
+    emit32(a, (u32)((QNAN | SIGN_BIT) >> 50));
+    slow_path(a, CC_E, offset);
+
+    patch32(a, done, a->size);
+    patch32(a, same, a->size);
+    if (negate) {
+        emit8(a, 0x34);                         // xor al, 1
+        emit8(a, 1);
+    }
+    make_bool(a);
+    store_result(a);
+}
+
+// nil and false are the two tags after QNAN
+static void check_falsey(Asm *a)
+{
+    lea_tag(a, RCX, TAG_NIL);
+    emit_rr(a, 0, true, 0x29, RCX, RAX);        // sub rax, rcx
+    emit_rr(a, 0, true, 0x83, 7, RAX);          // cmp rax, 1
+    emit8(a, 1);
+}
+
+/* what the code does after an instruction it left to the vm: go on, go
+ * on in the compiled code of another frame, or leave with the status. */
+typedef struct {
+    u8 *target;         // in rax
+    JitStatus status;   // in edx
+} Resume;
+
+static Resume exec_instr(u8 *instr)
+{
+    JitStatus status = vm_jit_exec(instr);
+    if (status == JIT_FRAME) {
+        CallFrame *frame = &vm.frames[vm.frame_size - 1];
+        ObjFunction *fun = frame->closure->fun;
+        if (fun->jit != NULL)
+            return (Resume){ fun->jit->mem + fun->jit->entries[frame->ip - fun->chunk.code], JIT_NEXT };
+    }
+    return (Resume){ NULL, status };
+}
+
+/* hands the instruction to the vm through exec_instr(). calls and returns
+ * between compiled functions go from one's code to the other's without
+ * going back to the interpreter loop. the stack may have moved. */
+static void exec(Asm *a, u32 offset, u32 next)
+{
+    store(a, R14, SP_OFFSET, R13);
+    lea(a, RAX, R15, next);
+    store(a, RBX, offsetof(CallFrame, ip), RAX);
+    lea(a, RDI, R15, offset);
+    mov_imm(a, RAX, (uintptr_t)exec_instr);
+    emit_rr(a, 0, false, 0xff, 2, RAX);         // call rax
+    emit_rr(a, 0, true, 0x85, RAX, RAX);        // test rax, rax
+    jump_to(a, CC_NE, a->switch_frame);
+    load(a, R13, R14, SP_OFFSET);
+    emit_rr(a, 0, false, 0x85, RDX, RDX);       // test edx, edx
+    jump_to(a, CC_NE, a->exit);
+    load(a, R12, RBX, offsetof(CallFrame, slots));
+}
+
+static void prologue(Asm *a)
+{
+    push(a, RBP);
+    push(a, RBX);
+    push(a, R12);
+    push(a, R13);
+    push(a, R14);
+    push(a, R15);
+    emit_rr(a, 0, true, 0x83, 5, RSP);          // sub rsp, 8
+    emit8(a, 8);
+    emit_rr(a, 0, true, 0x89, RDI, RBX);        // mov rbx, rdi
+    load(a, R12, RBX, offsetof(CallFrame, slots));
+    mov_imm(a, R14, (uintptr_t)&vm);
+    load(a, R13, R14, SP_OFFSET);
+    mov_imm(a, R15, (uintptr_t)a->chunk->code);
+    mov_imm(a, RBP, QNAN);
+    emit_rr(a, 0, false, 0xff, 4, RSI);         // jmp rsi
+
+    // to the target in rax, in the code of the function of the top frame
+    a->switch_frame = a->size;
+    emit_rr(a, 0, true, 0x89, RAX, RSI);        // mov rsi, rax
+    load(a, RAX, R14, (i32)offsetof(VM, frame_size));
+    emit_sib(a, true, 0x8d, RAX, RAX, RAX, 1, 0);     // lea rax, [rax + rax * 2]
+    load(a, RBX, R14, (i32)offsetof(VM, frames));
+    emit_sib(a, true, 0x8d, RBX, RBX, RAX, 3, -(i32)sizeof(CallFrame));   // lea rbx, [rbx + rax * 8 - 24]
+    load(a, R12, RBX, offsetof(CallFrame, slots));
+    load(a, R13, R14, SP_OFFSET);
+    load(a, RAX, RBX, offsetof(CallFrame, closure));
+    load(a, RAX, RAX, offsetof(ObjClosure, fun));
+    load(a, R15, RAX, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+    emit_rr(a, 0, false, 0xff, 4, RSI);         // jmp rsi
+
+    // with the status in edx
+    a->exit = a->size;
+    emit_rr(a, 0, false, 0x89, RDX, RAX);       // mov eax, edx
+    emit_rr(a, 0, true, 0x83, 0, RSP);          // add rsp, 8
+    emit8(a, 8);
+    pop(a, R15);
+    pop(a, R14);
+    pop(a, R13);
+    pop(a, R12);
+    pop(a, RBX);
+    pop(a, RBP);
+    emit8(a, 0xc3);                             // ret
+}
+
+// the 16-bit operand of globals and branches. it's only read for them: an
+// instruction without one can be the last byte of the chunk
+#define OPERAND() ((u16)(code[1] << 8 | code[2]))
+
+static void emit_instr(Asm *a, u32 offset, u32 next)
+{
+    Chunk *chunk = a->chunk;
+    u8 *code = &chunk->code[offset];
+
+    switch (code[0]) {
+    case OP_CONSTANT: {
+        Value *constant = &chunk->constants.values[code[1]];
+        if (IS_OBJ(*constant)) {
+            // the collector updates the constant when it moves the object
+            mov_imm(a, RAX, (uintptr_t)constant);
+            load(a, RAX, RAX, 0);
+        } else
+            mov_imm(a, RAX, *constant);
+        push_value(a);
+        break;
+    }
+    case OP_NIL:    lea_tag(a, RAX, TAG_NIL);   push_value(a); break;
+    case OP_TRUE:   lea_tag(a, RAX, TAG_TRUE);  push_value(a); break;
+    case OP_FALSE:  lea_tag(a, RAX, TAG_FALSE); push_value(a); break;
+    case OP_POP:    lea(a, R13, R13, -8);                       break;
+    // the globals are reloaded every time, the repl adds to them
+    case OP_DEFINE_GLOBAL:
+        load(a, RAX, R14, GLOBALS_OFFSET);
+        load(a, RCX, R13, -8);
+        store(a, RAX, OPERAND() * sizeof(Value), RCX);
+        lea(a, R13, R13, -8);
+        break;
+    case OP_GET_GLOBAL:
+        load(a, RAX, R14, GLOBALS_OFFSET);
+        load(a, RAX, RAX, OPERAND() * sizeof(Value));
+        lea_tag(a, RCX, TAG_UNDEF);
+        emit_rr(a, 0, true, 0x39, RCX, RAX);    // cmp rax, rcx
+        slow_path(a, CC_E, offset);
+        push_value(a);
+        break;
+    case OP_SET_GLOBAL:
+        load(a, RAX, R14, GLOBALS_OFFSET);
+        lea_tag(a, RCX, TAG_UNDEF);
+        emit_rm(a, 0, true, 0x3b, RCX, RAX, OPERAND() * sizeof(Value));   // cmp rcx, [...]
+        slow_path(a, CC_E, offset);
+        load(a, RCX, R13, -8);
+        store(a, RAX, OPERAND() * sizeof(Value), RCX);
+        break;
+    case OP_GET_LOCAL:
+        load(a, RAX, R12, code[1] * sizeof(Value));
+        push_value(a);
+        break;
+    case OP_SET_LOCAL:
+        load(a, RAX, R13, -8);
+        store(a, R12, code[1] * sizeof(Value), RAX);
+        break;
+    case OP_GET_LOCAL2:
+        load(a, RAX, R12, code[1] * sizeof(Value));
+        load(a, RCX, R12, code[2] * sizeof(Value));
+        store(a, R13, 0, RAX);
+        store(a, R13, 8, RCX);
+        lea(a, R13, R13, 16);
+        break;
+    case OP_GET_UPVALUE:
+        load(a, RAX, RBX, offsetof(CallFrame, closure));
+        load(a, RAX, RAX, offsetof(ObjClosure, upvalues));
+        load(a, RAX, RAX, code[1] * sizeof(ObjUpvalue *));
+        load(a, RAX, RAX, offsetof(ObjUpvalue, location));
+        load(a, RAX, RAX, 0);
+        push_value(a);
+        break;
+    /* a field of the shape in the first cache entry. the entry is read
+     * when the code runs, as the cache is filled and the collector moves
+     * the shape. */
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD: {
+        InlineCache *cache = &chunk->caches[code[2] << 8 | code[3]];
+        load(a, RAX, R13, -8);
+        emit_rr(a, 0, true, 0x89, RAX, RDX);    // mov rdx, rax
+        emit_rr(a, 0, true, 0xc1, 5, RDX);      // shr rdx, 50
+        emit8(a, 50);
+        emit_rr(a, 0, false, 0x81, 7, RDX);     // cmp edx, 0x3fff
+        emit32(a, (u32)((QNAN | SIGN_BIT) >> 50));
+        slow_path(a, CC_NE, offset);
+        emit_rr(a, 0, true, 0x89, RAX, RCX);    // mov rcx, rax
+        emit_rr(a, 0, true, 0xc1, 4, RCX);      // shl rcx, 14
+        emit8(a, 14);
+        emit_rr(a, 0, true, 0xc1, 5, RCX);      // shr rcx, 14
+        emit8(a, 14);
+        emit_rm(a, 0, false, 0x81, 7, RCX, offsetof(Obj, type));  // cmp dword [rcx], OBJ_INSTANCE
+        emit32(a, OBJ_INSTANCE);
+        slow_path(a, CC_NE, offset);
+        mov_imm(a, RAX, (uintptr_t)cache);
+        emit_rm(a, 0, false, 0x80, 7, RAX, offsetof(InlineCache, size));  // cmp byte [...], 0
+        emit8(a, 0);
+        slow_path(a, CC_E, offset);
+        load(a, RDX, RAX, offsetof(InlineCache, entries) + offsetof(CacheEntry, shape));
+        emit_rm(a, 0, true, 0x3b, RDX, RCX, offsetof(ObjInstance, shape));   // cmp rdx, [...]
+        slow_path(a, CC_NE, offset);
+        emit_rm(a, 0, false, 0x8b, RDX, RAX, offsetof(InlineCache, entries) + offsetof(CacheEntry, slot));
+        emit_rr(a, 0, false, 0x85, RDX, RDX);   // test edx, edx
+        slow_path(a, CC_S, offset);             // a method
+        emit_rm(a, 0, false, 0x3b, RDX, RCX, offsetof(ObjInstance, inline_cap));
+        u32 extra = jump(a, CC_AE);
+        emit_sib(a, true, 0x8b, RAX, RCX, RDX, 3, offsetof(ObjInstance, fields));  // mov rax, [rcx + rdx * 8 + ...]
+        u32 done = jump(a, -1);
+        patch32(a, extra, a->size);
+        emit_rm(a, 0, false, 0x2b, RDX, RCX, offsetof(ObjInstance, inline_cap));   // sub edx, [...]
+        load(a, RCX, RCX, offsetof(ObjInstance, extra_fields));
+        emit_sib(a, true, 0x8b, RAX, RCX, RDX, 3, 0);
+        patch32(a, done, a->size);
+        store(a, R13, -8, RAX);
+        break;
+    }
+    /* to a compiled caller, as long as no upvalue is left to close and
+     * it isn't the script that returns. */
+    case OP_RETURN: {
+        load(a, RAX, R14, (i32)offsetof(VM, open_upvalues));
+        emit_rr(a, 0, true, 0x85, RAX, RAX);    // test rax, rax
+        u32 no_upvalues = jump(a, CC_E);
+        emit_rm(a, 0, true, 0x39, R12, RAX, offsetof(ObjUpvalue, location));  // cmp [...], r12
+        slow_path(a, CC_AE, offset);
+        patch32(a, no_upvalues, a->size);
+        load(a, RAX, R14, (i32)offsetof(VM, frame_size));
+        emit_rr(a, 0, true, 0x83, 7, RAX);      // cmp rax, 1
+        emit8(a, 1);
+        slow_path(a, CC_E, offset);
+        emit_rr(a, 0, true, 0x83, 5, RAX);      // sub rax, 1
+        emit8(a, 1);
+        store(a, R14, (i32)offsetof(VM, frame_size), RAX);
+        load(a, RAX, R13, -8);
+        store(a, R12, 0, RAX);
+        lea(a, R13, R12, 8);
+        lea(a, RBX, RBX, -(i32)sizeof(CallFrame));
+        load(a, R12, RBX, offsetof(CallFrame, slots));
+        load(a, RAX, RBX, offsetof(CallFrame, closure));
+        load(a, RAX, RAX, offsetof(ObjClosure, fun));
+        load(a, R15, RAX, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+        load(a, RAX, RAX, offsetof(ObjFunction, jit));
+        emit_rr(a, 0, true, 0x85, RAX, RAX);
+        u32 interpreted = jump(a, CC_E);
+        load(a, RCX, RBX, offsetof(CallFrame, ip));
+        emit_rr(a, 0, true, 0x29, R15, RCX);    // sub rcx, r15
+        load(a, RDX, RAX, offsetof(JitCode, entries));
+        emit_sib(a, false, 0x8b, RDX, RDX, RCX, 2, 0);    // mov edx, [rdx + rcx * 4]
+        emit_rm(a, 0, true, 0x03, RDX, RAX, offsetof(JitCode, mem));  // add rdx, [...]
+        emit_rr(a, 0, false, 0xff, 4, RDX);     // jmp rdx
+        patch32(a, interpreted, a->size);
+        store(a, R14, SP_OFFSET, R13);
+        mov_imm(a, RDX, JIT_FRAME);
+        jump_to(a, -1, a->exit);
+        break;
+    }
+    case OP_INC_LOCAL: {
+        Value k = chunk->constants.values[code[2]];
+        load(a, RAX, R12, code[1] * sizeof(Value));
+        check_num(a, RAX, offset);
+        emit_rr(a, 0x66, true, 0x0f6e, XMM0, RAX);
+        mov_imm(a, RCX, k);
+        emit_rr(a, 0x66, true, 0x0f6e, XMM1, RCX);
+        emit_rr(a, 0xf2, false, 0x0f58, XMM0, XMM1);    // addsd
+        emit_rr(a, 0x66, true, 0x0f7e, XMM0, RAX);
+        store(a, R12, code[1] * sizeof(Value), RAX);
+        break;
+    }
+    // the quickened forms are taken for what they were quickened from
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:    arith(a, 0x0f58, offset); break;
+    case OP_SUB:
+    case OP_SUB_NUM:    arith(a, 0x0f5c, offset); break;
+    case OP_MUL:
+    case OP_MUL_NUM:    arith(a, 0x0f59, offset); break;
+    case OP_DIV:
+    case OP_DIV_NUM:    arith(a, 0x0f5e, offset); break;
+    // a nan compares unordered, which sets every flag ja looks at
+    case OP_GREATER:
+    case OP_GREATER_NUM:    compare(a, XMM0, XMM1, CC_A, offset);  break;
+    case OP_LESS:
+    case OP_LESS_NUM:       compare(a, XMM1, XMM0, CC_A, offset);  break;
+    case OP_LESS_EQ:        compare(a, XMM0, XMM1, CC_BE, offset); break;
+    case OP_GREATER_EQ:     compare(a, XMM1, XMM0, CC_BE, offset); break;
+    case OP_EQ:             equal(a, false, offset); break;
+    case OP_NOT_EQ:         equal(a, true, offset);  break;
+    case OP_BRANCH_NOT_LESS:
+        compare_branch(a, XMM1, XMM0, CC_BE, offset, OPERAND() + next);
+        break;
+    case OP_BRANCH_NOT_GREATER:
+        compare_branch(a, XMM0, XMM1, CC_BE, offset, OPERAND() + next);
+        break;
+    case OP_BRANCH_NOT_LESS_EQ:
+        compare_branch(a, XMM0, XMM1, CC_A, offset, OPERAND() + next);
+        break;
+    case OP_BRANCH_NOT_GREATER_EQ:
+        compare_branch(a, XMM1, XMM0, CC_A, offset, OPERAND() + next);
+        break;
+    case OP_NOT:
+        load(a, RAX, R13, -8);
+        check_falsey(a);
+        setcc(a, CC_BE, RAX);
+        make_bool(a);
+        store(a, R13, -8, RAX);
+        break;
+    case OP_NEGATE:
+        load(a, RAX, R13, -8);
+        check_num(a, RAX, offset);
+        emit_rr(a, 0, true, 0x0fba, 7, RAX);    // btc rax, 63
+        emit8(a, 63);
+        store(a, R13, -8, RAX);
+        break;
+    case OP_BRANCH:
+        branch(a, -1, OPERAND() + next);
+        break;
+    case OP_BRANCH_FALSE:
+        load(a, RAX, R13, -8);
+        check_falsey(a);
+        branch(a, CC_BE, OPERAND() + next);
+        break;
+    case OP_BRANCH_BACK:
+        emit_rm(a, 0, false, 0x83, 7, R14, PENDING_OFFSET);    // cmp dword [...], 0
+        emit8(a, 0);
+        slow_path(a, CC_NE, offset);
+        branch(a, -1, next - OPERAND());
+        break;
+    default:
+        exec(a, offset, next);
+        break;
+    }
+}
+
+// the safepoint of a backward branch, which then takes it
+static void emit_safepoint(Asm *a, u32 target)
+{
+    store(a, R14, SP_OFFSET, R13);
+    lea(a, RAX, R15, target);
+    store(a, RBX, offsetof(CallFrame, ip), RAX);
+    mov_imm(a, RAX, (uintptr_t)vm_jit_safepoint);
+    emit_rr(a, 0, false, 0xff, 2, RAX);         // call rax
+    jump_to(a, -1, a->entries[target]);
+}
+
+static bool assemble(Asm *a)
+{
+    Chunk *chunk = a->chunk;
+    for (size_t i = 0; i <= chunk->size; i++)
+        a->entries[i] = NO_ENTRY;
+    prologue(a);
+    for (size_t offset = 0; offset < chunk->size; ) {
+        size_t next = offset + chunk_instr_size(chunk, offset);
+        a->entries[offset] = a->size;
+        emit_instr(a, offset, next);
+        offset = next;
+    }
+
+    for (size_t i = 0; i < a->patch_size; i++) {
+        Patch *patch = &a->patches[i];
+        if (patch->target >= chunk->size || a->entries[patch->target] == NO_ENTRY)
+            return false;
+        patch32(a, patch->at, a->entries[patch->target]);
+    }
+
+    // one slow path for each instruction that has any
+    u32 *slow_at = malloc(sizeof(u32) * chunk->size);
+    if (!slow_at)
+        return false;
+    for (size_t i = 0; i < chunk->size; i++)
+        slow_at[i] = NO_ENTRY;
+    for (size_t i = 0; i < a->slow_size; i++) {
+        SlowJump *jump = &a->slow[i];
+        u32 offset = jump->offset;
+        if (slow_at[offset] == NO_ENTRY) {
+            slow_at[offset] = a->size;
+            u32 next = offset + chunk_instr_size(chunk, offset);
+            if (chunk->code[offset] == OP_BRANCH_BACK)
+                emit_safepoint(a, chunk_branch_target(chunk, offset));
+            else {
+                exec(a, offset, next);
+                // a return never goes on
+                if (chunk->code[offset] != OP_RETURN)
+                    jump_to(a, -1, a->entries[next]);
+            }
+        }
+        patch32(a, jump->at, slow_at[offset]);
+    }
+    free(slow_at);
+    return true;
+}
+
+void jit_compile(ObjFunction *fun)
+{
+    Asm a = { .chunk = &fun->chunk };
+    a.entries = malloc(sizeof(u32) * (fun->chunk.size + 1));
+    if (!a.entries)
+        return;
+    JitCode *code = NULL;
+    if (!assemble(&a))
+        goto done;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (a.size + page - 1) / page * page;
+    u8 *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        goto done;
+    memcpy(mem, a.code, a.size);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        goto done;
+    }
+    code = malloc(sizeof(JitCode));
+    if (!code) {
+        munmap(mem, size);
+        goto done;
+    }
+    code->mem = mem;
+    code->size = size;
+    code->entries = a.entries;
+    a.entries = NULL;
+    fun->jit = code;
+
+done:
+    free(a.code);
+    free(a.patches);
+    free(a.slow);
+    free(a.entries);
+}
+
+JitStatus jit_enter(CallFrame *frame)
+{
+    ObjFunction *fun = frame->closure->fun;
+    JitCode *code = fun->jit;
+    JitStatus (*enter)(CallFrame *frame, u8 *target);
+    memcpy(&enter, &code->mem, sizeof(enter));
+    return enter(frame, code->mem + code->entries[frame->ip - fun->chunk.code]);
+}
+
+void jit_free(JitCode *code)
+{
+    if (code == NULL)
+        return;
+    munmap(code->mem, code->size);
+    free(code->entries);
+    free(code);
+}
+
+#else
+
+void jit_compile(ObjFunction *fun)
+{
+}
+
+JitStatus jit_enter(CallFrame *frame)
+{
+    return JIT_ERROR;
+}
+
+void jit_free(JitCode *code)
+{
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef JIT_H_INCLUDED
+#define JIT_H_INCLUDED
+
+#include "uint.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include "debug.h"
+
+/*
+ * baseline jit for x86-64. a function that has run hot, counting calls
+ * and loop iterations, is translated into machine code one instruction
+ * at a time, from a fixed template for each opcode.
+ * the code works on the vm's own frames and stack, so it can be entered
+ * at any instruction: a frame keeps its ip pointing into the bytecode,
+ * and the interpreter loop still moves between frames, jumping into the
+ * code of compiled functions whenever it gets to one. the templates only
+ * handle numbers, locals, globals, branches, cached field loads and
+ * returns by themselves and leave the rest to vm_jit_exec(), so the
+ * machine code never holds a pointer to an object the collector could
+ * move.
+ * traced builds keep to the interpreter, which is what they trace.
+ */
+#if defined(__x86_64__) && defined(__unix__) && defined(NAN_BOXING) \
+ && !defined(DEBUG_TRACE_EXECUTION)
+#define JIT_ENABLED
+#endif
+
+#define JIT_THRESHOLD 1000  // calls and loop iterations before compiling
+
+typedef enum {
+    JIT_NEXT,   // go on with the next instruction
+    JIT_FRAME,  // the running frame changed
+    JIT_DONE,   // the script returned
+    JIT_ERROR,  // a runtime error was reported
+} JitStatus;
+
+typedef struct JitCode JitCode;
+
+void jit_compile(ObjFunction *fun);
+JitStatus jit_enter(CallFrame *frame);
+void jit_free(JitCode *code);
+
+// in vm.c: runs the instruction at instr, after frame->ip and vm.sp
+JitStatus vm_jit_exec(u8 *instr);
+void vm_jit_safepoint(void);
+
+#endif
@@ -1,6 +1,14 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include "vm.h"
+#include "peephole.h"
+#include "memory.h"
+#include "profile.h"
 
 static void repl()
 {
@@ -51,33 +59,207 @@ static char *read_file(const char *path)
     return buf;
 }
 
-static void run_file(const char *path)
+static int run_file(const char *path)
 {
     char *src = read_file(path);
     VMResult result = vm_interpret(src, path);
     free(src);
 
     if (result == VM_COMPILE_ERROR)
-        exit(2);
+        return 2;
     if (result == VM_RUNTIME_ERROR)
-        exit(3);
+        return 3;
+    return 0;
+}
+
+// a whole number from min to max, and nothing after it
+static bool parse_int(const char *str, long min, long max, long *n)
+{
+    char *end;
+    errno = 0;
+    *n = strtol(str, &end, 10);
+    return end != str && *end == '\0' && errno != ERANGE && *n >= min && *n <= max;
+}
+
+// a number of bytes, with an optional k, m or g suffix
+static bool parse_size(const char *str, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (end == str || errno == ERANGE)
+        return false;
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    // too big to count in bytes
+    if (n > SIZE_MAX >> shift)
+        return false;
+    *size = (size_t)n << shift;
+    return *end == '\0';
+}
+
+static bool parse_factor(const char *str, double *factor)
+{
+    char *end;
+    *factor = strtod(str, &end);
+    return end != str && *end == '\0' && *factor > 1 && *factor <= 100;
+}
+
+static bool bad_env(const char *name)
+{
+    fprintf(stderr, "error: invalid value for %s\n", name);
+    return false;
+}
+
+// the environment gives the defaults of the heap options
+static bool read_env(size_t *initial_heap, double *grow_factor, size_t *max_heap)
+{
+    const char *env;
+    if ((env = getenv("CLOX_GC_INITIAL_HEAP")) != NULL && !parse_size(env, initial_heap))
+        return bad_env("CLOX_GC_INITIAL_HEAP");
+    if ((env = getenv("CLOX_GC_GROW_FACTOR")) != NULL && !parse_factor(env, grow_factor))
+        return bad_env("CLOX_GC_GROW_FACTOR");
+    if ((env = getenv("CLOX_GC_MAX_HEAP")) != NULL && !parse_size(env, max_heap))
+        return bad_env("CLOX_GC_MAX_HEAP");
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: clox [options] [file]\n"
+                    "options:\n"
+                    "    --alloc-profile[=N]\n"
+                    "                       report which lines allocate the most at exit,\n"
+                    "                       sampling about 1 in N allocations (default 64,\n"
+                    "                       1 counts every one)\n"
+                    "    --gc-compact       compact the heap when it gets fragmented\n"
+                    "    --gc-grow-factor=F let the heap grow F times its live size between\n"
+                    "                       collections (default 2, or CLOX_GC_GROW_FACTOR)\n"
+                    "    --gc-incremental   interleave full collections with execution\n"
+                    "    --gc-initial-heap=SIZE\n"
+                    "                       don't collect before the heap reaches SIZE bytes,\n"
+                    "                       with a k, m or g suffix (default 1m, or\n"
+                    "                       CLOX_GC_INITIAL_HEAP)\n"
+                    "    --gc-max-heap=SIZE fail when more than SIZE bytes stay live\n"
+                    "                       (default no limit, or CLOX_GC_MAX_HEAP)\n"
+                    "    --gc-stats         print collection counters and pauses at exit\n"
+                    "    --gc-threads=N     mark the heap with N threads\n"
+                    "    --max-call-depth=N fail with a stack overflow when calls nest\n"
+                    "                       deeper than N (default 100000)\n"
+                    "    --no-jit           never compile hot functions to machine code\n"
+                    "    --peephole-stats   print which superinstructions were formed\n");
 }
 
 int main(int argc, char *argv[])
 {
-    vm_init();
+    bool peephole_stats = false;
+    long alloc_profile = 0;
+    bool gc_incremental = false;
+    bool gc_compact = false;
+    bool gc_stats = false;
+    int gc_threads = 1;
+    size_t gc_initial_heap = 1024 * 1024;
+    double gc_grow_factor = 2;
+    size_t gc_max_heap = 0;
+    long max_call_depth = CALL_DEPTH_DEFAULT;
+    bool jit = true;
 
-    if (argc == 1)
-        repl();
-    else if (argc == 2)
-        run_file(argv[1]);
-    else {
-        fprintf(stderr, "usage: clox [file]\n");
-        vm_free();
+    if (!read_env(&gc_initial_heap, &gc_grow_factor, &gc_max_heap))
         return 1;
+
+    int i = 1;
+    for ( ; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--peephole-stats") == 0)
+            peephole_stats = true;
+        else if (strcmp(argv[i], "--alloc-profile") == 0)
+            alloc_profile = 64;
+        else if (strncmp(argv[i], "--alloc-profile=", 16) == 0) {
+            if (!parse_int(argv[i] + 16, 1, LONG_MAX, &alloc_profile)) {
+                usage();
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--max-call-depth=", 17) == 0) {
+            if (!parse_int(argv[i] + 17, 1, LONG_MAX, &max_call_depth)) {
+                usage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--no-jit") == 0)
+            jit = false;
+        else if (strcmp(argv[i], "--gc-incremental") == 0)
+            gc_incremental = true;
+        else if (strcmp(argv[i], "--gc-compact") == 0)
+            gc_compact = true;
+        else if (strcmp(argv[i], "--gc-stats") == 0)
+            gc_stats = true;
+        else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            long n;
+            if (!parse_int(argv[i] + 13, 1, 64, &n)) {
+                usage();
+                return 1;
+            }
+            gc_threads = n;
+        }
+        else if (strncmp(argv[i], "--gc-initial-heap=", 18) == 0) {
+            if (!parse_size(argv[i] + 18, &gc_initial_heap)) {
+                usage();
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--gc-grow-factor=", 17) == 0) {
+            if (!parse_factor(argv[i] + 17, &gc_grow_factor)) {
+                usage();
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--gc-max-heap=", 14) == 0) {
+            if (!parse_size(argv[i] + 14, &gc_max_heap)) {
+                usage();
+                return 1;
+            }
+        }
+        else {
+            usage();
+            return 1;
+        }
     }
 
+    if (argc - i > 1) {
+        usage();
+        return 1;
+    }
+
+    vm_init();
+    vm.gc_incremental = gc_incremental;
+    vm.gc_threads = gc_threads;
+    vm.gc_compact = gc_compact;
+    vm.gc_grow_factor = gc_grow_factor;
+    vm.gc_max_heap = gc_max_heap;
+    vm.gc_initial_heap = gc_initial_heap;
+    vm.frame_limit = max_call_depth;
+    vm.jit = vm.jit && jit;
+    if (alloc_profile > 0)
+        profile_init(alloc_profile);
+    vm.next_gc = gc_max_heap > 0 && gc_initial_heap > gc_max_heap ? gc_max_heap : gc_initial_heap;
+
+    int status = 0;
+    if (i == argc)
+        repl();
+    else
+        status = run_file(argv[i]);
+
+    if (peephole_stats)
+        peephole_print_stats();
+    if (gc_stats)
+        gc_print_stats();
+    profile_print();
+
     vm_free();
 
-    return 0;
+    return status;
 }
@@ -3,6 +3,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
 #include "value.h"
 #include "object.h"
 #include "table.h"
@@ -10,9 +15,32 @@
 #include "list.h"
 #include "compiler.h"
 #include "debug.h"
+#include "deque.h"
+#include "heap.h"
+#include "pool.h"
 
-#define GC_HEAP_GROW_FACTOR 2
+#define GC_NURSERY_SIZE     (1024 * 1024)
+#define GC_INITIAL_HEAP     (1024 * 1024)
+#define GC_LARGE_OBJECT     1024    // bigger objects skip the nursery
+#define GC_STEP_SIZE        (64 * 1024) // allocation between incremental steps
+#define GC_STEP_RATIO       4           // heap bytes traced or swept per byte allocated
+#define GC_NURSERY_MARKS    (GC_NURSERY_SIZE / GC_NURSERY_GRANULE / 64)
+#define GC_COMPACT_THRESHOLD 0.25   // share of the pages compaction would free
+#define GC_COMPACT_MIN_HEAP  (4 * 1024 * 1024)
 
+static bool collecting = false;
+static double live_share = 1.0;    // of the heap, as of the last marking
+static size_t marked_bytes = 0;     // vm.bytes_allocated when marking ended
+static bool compacting = false;
+
+static void gc_mark_arr(ValueArray *arr)
+{
+    for (size_t i = 0; i < arr->size; i++)
+        gc_mark_value(arr->values[i]);
+}
+
+/* code compiled by the jit holds no roots of its own: its values stay on
+ * the stack, and it only knows the addresses of its chunk's arrays. */
 static void mark_roots()
 {
     for (Value *slot = vm.stack; slot < vm.sp; slot++)
@@ -21,15 +49,28 @@ static void mark_roots()
         gc_mark_obj((Obj *) vm.frames[i].closure);
     LIST_FOR_EACH(ObjUpvalue, vm.open_upvalues, upvalue)
         gc_mark_obj((Obj *) upvalue);
-    gc_mark_table(&vm.globals);
+    gc_mark_table(&vm.global_slots);
+    gc_mark_arr(&vm.global_names);
+    gc_mark_arr(&vm.global_values);
     compiler_mark_roots();
     gc_mark_obj((Obj *)vm.init_string);
+    gc_mark_arr(&vm.selectors);
+    gc_mark_obj((Obj *)vm.empty_shape);
+    gc_mark_obj((Obj *)vm.gc_stats_class);
 }
 
-static void gc_mark_arr(ValueArray *arr)
+static void gc_mark_caches(Chunk *chunk)
 {
-    for (size_t i = 0; i < arr->size; i++)
-        gc_mark_value(arr->values[i]);
+    for (size_t i = 0; i < chunk->cache_size; i++) {
+        InlineCache *cache = &chunk->caches[i];
+        for (int j = 0; j < cache->size; j++) {
+            CacheEntry *entry = &cache->entries[j];
+            gc_mark_obj((Obj *)entry->klass);
+            gc_mark_obj((Obj *)entry->shape);
+            gc_mark_obj((Obj *)entry->next_shape);
+            gc_mark_value(entry->method);
+        }
+    }
 }
 
 static void mark_black(Obj *obj)
@@ -44,6 +85,13 @@ static void mark_black(Obj *obj)
     case OBJ_NATIVE:
     case OBJ_STRING:
         break;
+    case OBJ_ROPE: {
+        ObjRope *rope = (ObjRope *)obj;
+        gc_mark_obj((Obj *)rope->flat);
+        gc_mark_obj(rope->left);
+        gc_mark_obj(rope->right);
+        break;
+    }
     case OBJ_UPVALUE:
         gc_mark_value(((ObjUpvalue *)obj)->closed);
         break;
@@ -51,6 +99,7 @@ static void mark_black(Obj *obj)
         ObjFunction *fun = (ObjFunction *)obj;
         gc_mark_obj((Obj *)fun->name);
         gc_mark_arr(&fun->chunk.constants);
+        gc_mark_caches(&fun->chunk);
         break;
     }
     case OBJ_CLOSURE: {
@@ -63,13 +112,17 @@ static void mark_black(Obj *obj)
     case OBJ_CLASS: {
         ObjClass *klass = (ObjClass *)obj;
         gc_mark_obj((Obj *) klass->name);
-        gc_mark_table(&klass->methods);
+        gc_mark_obj((Obj *) klass->init);
+        for (int i = 0; i < klass->method_cap; i++)
+            gc_mark_obj((Obj *) klass->methods[i]);
         break;
     }
     case OBJ_INSTANCE: {
         ObjInstance *inst = (ObjInstance *)obj;
         gc_mark_obj((Obj *)inst->klass);
-        gc_mark_table(&inst->fields);
+        gc_mark_obj((Obj *)inst->shape);
+        for (int i = 0; i < inst->shape->slot_count; i++)
+            gc_mark_value(*instance_field(inst, i));
         break;
     }
     case OBJ_BOUND_METHOD: {
@@ -78,72 +131,796 @@ static void mark_black(Obj *obj)
         gc_mark_obj((Obj *)bound->method);
         break;
     }
+    case OBJ_SHAPE: {
+        ObjShape *shape = (ObjShape *)obj;
+        gc_mark_obj((Obj *)shape->parent);
+        gc_mark_obj((Obj *)shape->name);
+        gc_mark_table(&shape->transitions);
+        break;
+    }
+    }
+}
+
+/*
+ * parallel marking, used by trace_refs() when vm.gc_threads > 1. the gray
+ * objects are spread over one deque per thread, then every thread marks
+ * from its own deque and steals from the others once it runs dry.
+ * gc_mark_obj() sets mark bits atomically and pushes to the deque of the
+ * calling thread, which it finds in marker. the threads other than the
+ * main one are started on first use and wait for work in between.
+ */
+typedef struct {
+    thrd_t thread;
+    int id;
+    Deque deque;
+} Marker;
+
+static Marker *markers = NULL;
+static int marker_count = 0;    // the main thread included
+static mtx_t markers_lock;
+static cnd_t markers_start;
+static cnd_t markers_done;
+static unsigned markers_epoch = 0;
+static int markers_running = 0;
+static bool markers_quit = false;
+static atomic_int markers_idle;
+static _Thread_local Deque *marker = NULL;
+
+static Obj *steal_work(int self)
+{
+    for (int i = 1; i < marker_count; i++) {
+        Obj *obj = deque_steal(&markers[(self + i) % marker_count].deque);
+        if (obj != NULL)
+            return obj;
+    }
+    return NULL;
+}
+
+static bool any_work()
+{
+    for (int i = 0; i < marker_count; i++)
+        if (!deque_is_empty(&markers[i].deque))
+            return true;
+    return false;
+}
+
+/* marking is over once every thread is idle: only a busy thread can
+ * push, and an idle one has an empty deque. */
+static void mark_in_parallel(int self)
+{
+    Deque *deque = &markers[self].deque;
+    marker = deque;
+    for (;;) {
+        Obj *obj;
+        while ((obj = deque_pop(deque)) != NULL || (obj = steal_work(self)) != NULL)
+            mark_black(obj);
+        atomic_fetch_add(&markers_idle, 1);
+        while (!any_work()) {
+            if (atomic_load(&markers_idle) == marker_count) {
+                marker = NULL;
+                return;
+            }
+            thrd_yield();
+        }
+        atomic_fetch_sub(&markers_idle, 1);
+    }
+}
+
+static int marker_main(void *arg)
+{
+    Marker *self = arg;
+    unsigned epoch = 0;
+    mtx_lock(&markers_lock);
+    for (;;) {
+        while (markers_epoch == epoch && !markers_quit)
+            cnd_wait(&markers_start, &markers_lock);
+        if (markers_quit)
+            break;
+        epoch = markers_epoch;
+        mtx_unlock(&markers_lock);
+        mark_in_parallel(self->id);
+        mtx_lock(&markers_lock);
+        if (--markers_running == 0)
+            cnd_signal(&markers_done);
     }
+    mtx_unlock(&markers_lock);
+    return 0;
+}
+
+static void start_markers()
+{
+    marker_count = vm.gc_threads;
+    markers = malloc(sizeof(Marker) * marker_count);
+    if (!markers)
+        abort();
+    mtx_init(&markers_lock, mtx_plain);
+    cnd_init(&markers_start);
+    cnd_init(&markers_done);
+    markers_quit = false;
+    for (int i = 0; i < marker_count; i++) {
+        markers[i].id = i;
+        deque_init(&markers[i].deque);
+        if (i > 0 && thrd_create(&markers[i].thread, marker_main, &markers[i]) != thrd_success)
+            abort();
+    }
+}
+
+static void stop_markers()
+{
+    if (markers == NULL)
+        return;
+    mtx_lock(&markers_lock);
+    markers_quit = true;
+    cnd_broadcast(&markers_start);
+    mtx_unlock(&markers_lock);
+    for (int i = 0; i < marker_count; i++) {
+        if (i > 0)
+            thrd_join(markers[i].thread, NULL);
+        deque_free(&markers[i].deque);
+    }
+    mtx_destroy(&markers_lock);
+    cnd_destroy(&markers_start);
+    cnd_destroy(&markers_done);
+    free(markers);
+    markers = NULL;
+    marker_count = 0;
+}
+
+static void trace_parallel()
+{
+    if (markers == NULL)
+        start_markers();
+
+    // the other threads are waiting, so their deques can be filled from here
+    for (size_t i = 0; i < vm.gray_stack.size; i++)
+        deque_push(&markers[i % marker_count].deque, vm.gray_stack.stack[i]);
+    vm.gray_stack.size = 0;
+    atomic_store(&markers_idle, 0);
+
+    mtx_lock(&markers_lock);
+    markers_epoch++;
+    markers_running = marker_count - 1;
+    cnd_broadcast(&markers_start);
+    mtx_unlock(&markers_lock);
+
+    mark_in_parallel(0);
+
+    mtx_lock(&markers_lock);
+    while (markers_running > 0)
+        cnd_wait(&markers_done, &markers_lock);
+    mtx_unlock(&markers_lock);
+    for (int i = 0; i < marker_count; i++)
+        deque_reset(&markers[i].deque);
 }
 
 static void trace_refs()
 {
+    if (vm.gc_threads > 1) {
+        trace_parallel();
+        return;
+    }
     while (vm.gray_stack.size > 0) {
         Obj *obj = vm.gray_stack.stack[--vm.gray_stack.size];
         mark_black(obj);
     }
 }
 
+// like trace_refs(), but stops after about budget bytes of objects
+static long trace_some(long budget)
+{
+    while (vm.gray_stack.size > 0 && budget > 0) {
+        Obj *obj = vm.gray_stack.stack[--vm.gray_stack.size];
+        mark_black(obj);
+        budget -= obj_size(obj);
+    }
+    return budget;
+}
+
 static void remove_whites(Table *tab)
 {
-    // TABLE_FOR_EACH(tab, entry) {
-    //     if (entry->key != NULL && !entry->key->obj.marked)
-    //         table_delete(tab, entry->key);
-    // }
-    for (size_t i = 0; i < tab->cap; i++) {
+    // backwards, because a delete from a small table moves the last key
+    // into the hole, and that key must still be looked at
+    for (size_t i = tab->cap; i-- > 0; ) {
         Entry *entry = &tab->entries[i];
-        if (entry->key != NULL && !entry->key->obj.marked)
+        if (entry->key != NULL && !gc_is_marked(&entry->key->obj))
             table_delete(tab, entry->key);
     }
 }
 
-static void sweep()
-{
-    Obj *prev = NULL;
-    Obj *obj  = vm.objects;
-    while (obj != NULL) {
-        if (obj->marked) {
-            obj->marked = false;
-            prev = obj;
-            obj  = obj->next;
-        } else {
-            Obj *unreached = obj;
-            obj = obj->next;
-            if (prev != NULL)
-                prev->next = obj;
-            else
-                vm.objects = obj;
-            obj_free(unreached);
+/* the heap grows by vm.gc_grow_factor between collections, but it's never
+ * collected below its initial size, nor allowed over its maximum. */
+static size_t next_limit(double limit)
+{
+    if (limit < vm.gc_initial_heap)
+        limit = vm.gc_initial_heap;
+    if (vm.gc_max_heap > 0 && limit > vm.gc_max_heap)
+        return vm.gc_max_heap;
+    return limit;
+}
+
+/* the heap is swept one page at a time: by heap_alloc(), when it looks
+ * for free cells in a page the sweep hasn't reached yet, by incremental
+ * steps, and in one go when the next collection is due. */
+static void begin_sweep()
+{
+    live_share = heap_begin_sweep();
+    marked_bytes = vm.bytes_allocated;
+    vm.gc_phase = GC_SWEEP;
+}
+
+/* what survived is what was there when marking ended minus what the
+ * sweep freed. after a lazy sweep vm.bytes_allocated can be far above
+ * that, since the mutator got to allocate in the meantime, but those
+ * objects are counted as live when incremental collections finish. */
+static void finish_sweep()
+{
+    size_t freed = heap_finish_sweep();
+    size_t live  = vm.gc_incremental ? vm.bytes_allocated : marked_bytes - freed;
+    vm.gc_phase = GC_IDLE;
+    vm.next_gc  = next_limit(live * vm.gc_grow_factor);
+    vm.gc_stats.freed_bytes += freed;
+
+    if (vm.gc_compact) {
+        size_t capacity, reclaimable;
+        heap_usage(&capacity, &reclaimable);
+        if (capacity >= GC_COMPACT_MIN_HEAP && reclaimable >= capacity * GC_COMPACT_THRESHOLD) {
+            // objects can only move at a safepoint
+            vm.gc_compact_pending = true;
+            vm.gc_pending = true;
         }
     }
 }
 
-void *reallocate(void *ptr, size_t old, size_t new)
+static size_t nursery_size(size_t size)
 {
-    vm.bytes_allocated += new - old;
+    return (size + GC_NURSERY_GRANULE - 1) & ~(size_t)(GC_NURSERY_GRANULE - 1);
+}
+
+#define NURSERY_FOR_EACH(obj)                                   \
+    for (Obj *obj = (Obj *)vm.nursery.start;                    \
+         (u8 *)obj < vm.nursery.top;                            \
+         obj = (Obj *)((u8 *)obj + nursery_size(young_size(obj))))
+
+// drop the remembered objects the sweep is about to free
+static void prune_remembered()
+{
+    size_t size = 0;
+    for (size_t i = 0; i < vm.remembered.size; i++) {
+        Obj *obj = vm.remembered.stack[i];
+        if (gc_is_marked(obj))
+            vm.remembered.stack[size++] = obj;
+    }
+    vm.remembered.size = size;
+}
+
+static void begin_marking()
+{
+    vm.gc_phase = GC_MARK;
+    mark_roots();
+}
+
+/* with incremental marking the barrier only covers stores into objects,
+ * so the roots are scanned again before the sweep can start. this step
+ * can't be split up. */
+static void finish_marking()
+{
+    mark_roots();
+    trace_refs();
+    remove_whites(&vm.strings);
+    prune_remembered();
+    vm.gc_stats.collections++;
+    // young objects get marked too, but aren't swept
+    memset(vm.nursery.marks, 0, GC_NURSERY_MARKS * sizeof(u64));
+    begin_sweep();
+}
+
+static u64 now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record_pause(u64 start, size_t *count, u64 *total, u64 *max)
+{
+    u64 pause = now() - start;
+    (*count)++;
+    *total += pause;
+    if (pause > *max)
+        *max = pause;
+    int bucket = 0;
+    for (u64 bound = 10000; bucket < GC_PAUSE_BUCKETS - 1 && pause >= bound; bound *= 10)
+        bucket++;
+    vm.gc_stats.pause_histogram[bucket]++;
+}
+
+#define MAJOR_PAUSE(start) \
+    record_pause(start, &vm.gc_stats.major_pauses, &vm.gc_stats.major_time, &vm.gc_stats.max_major_pause)
+#define MINOR_PAUSE(start) \
+    record_pause(start, &vm.gc_stats.minor_pauses, &vm.gc_stats.minor_time, &vm.gc_stats.max_minor_pause)
+
+/* one increment of a full collection, paid for by vm.gc_debt bytes of
+ * allocation. it only touches the old space, so unlike minor collections
+ * it can run whenever memory is allocated. */
+static void gc_step()
+{
+    u64 start = now();
+    long budget = vm.gc_debt * GC_STEP_RATIO;
+    vm.gc_debt = 0;
+    collecting = true;
+    if (vm.gc_phase == GC_IDLE)
+        begin_marking();
+    if (vm.gc_phase == GC_MARK) {
+        budget = trace_some(budget);
+        if (vm.gray_stack.size == 0)
+            finish_marking();
+    }
+    if (vm.gc_phase == GC_SWEEP && budget > 0 && heap_sweep(budget))
+        finish_sweep();
+    collecting = false;
+    MAJOR_PAUSE(start);
+}
+
+/* vm.bytes_allocated still counts the garbage the lazy sweep hasn't
+ * freed, so that's done first when it gets over the limit. */
+static void finish_lazy_sweep()
+{
+    u64 start = now();
+    collecting = true;
+    heap_sweep(LONG_MAX);
+    finish_sweep();
+    collecting = false;
+    MAJOR_PAUSE(start);
+}
 
-    if (new > old) {
+// a full collection with an eager sweep, whatever phase the gc is in
+static void collect_fully()
+{
+    if (vm.gc_phase == GC_SWEEP) {
+        heap_sweep(LONG_MAX);
+        finish_sweep();
+    }
+    if (vm.gc_phase == GC_IDLE)
+        begin_marking();
+    trace_refs();
+    finish_marking();
+    heap_sweep(LONG_MAX);
+    finish_sweep();
+}
+
+/* past the maximum, the heap is collected for real, without waiting for
+ * an incremental collection or a lazy sweep to catch up. if that isn't
+ * enough, the program needs more memory than it's allowed. */
+static void enforce_max_heap()
+{
+    u64 start = now();
+    collecting = true;
+    collect_fully();
+    collecting = false;
+    MAJOR_PAUSE(start);
+    if (vm.bytes_allocated > vm.gc_max_heap) {
+        fprintf(stderr, "out of memory: %zu bytes live, the heap is limited to %zu\n",
+            vm.bytes_allocated, vm.gc_max_heap);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void collect_if_needed(size_t allocated)
+{
+    if (vm.gc_max_heap > 0 && vm.bytes_allocated > vm.gc_max_heap) {
+        enforce_max_heap();
+        return;
+    }
+    if (!vm.gc_incremental) {
+        if (vm.bytes_allocated <= vm.next_gc)
+            return;
+        if (vm.gc_phase == GC_SWEEP) {
+            finish_lazy_sweep();
+            if (vm.bytes_allocated <= vm.next_gc)
+                return;
+        }
+        gc_collect();
+        return;
+    }
+    if (vm.gc_phase == GC_IDLE && vm.bytes_allocated <= vm.next_gc)
+        return;
+    vm.gc_debt += allocated;
+    if (vm.gc_debt >= GC_STEP_SIZE)
+        gc_step();
+}
+
+static Obj *alloc_old(size_t size)
+{
+    vm.bytes_allocated += size;
+    if (!collecting) {
 #ifdef DEBUG_STRESS_GC
         gc_collect();
 #endif
+        collect_if_needed(size);
     }
+    Obj *obj = heap_alloc(size);
+    obj->remembered = false;
+    obj->forwarded  = false;
+    return obj;
+}
 
-    if (vm.bytes_allocated > vm.next_gc)
-        gc_collect();
+/* minor collections: live young objects are copied out of the nursery
+ * into the old space. the young object is flagged as forwarded and the
+ * address of its copy is written over its first field, so the nursery
+ * copy is all that's needed to fix up the other references to it. */
+
+static Obj **forwarding(Obj *obj)
+{
+    return (Obj **)(obj + 1);
+}
+
+// the forwarding address can take the place of what the size depends on
+static size_t young_size(Obj *obj)
+{
+    return obj_size(obj->forwarded ? *forwarding(obj) : obj);
+}
 
-    if (new == 0) {
-        free(ptr);
-        return NULL;
+static Obj *promote(Obj *obj)
+{
+    size_t size = obj_size(obj);
+    Obj *copy = alloc_old(size);
+    vm.gc_stats.promoted_bytes += size;
+    copy->type = obj->type;
+    memcpy(copy + 1, obj + 1, size - sizeof(Obj));
+    if (obj->type == OBJ_UPVALUE) {
+        ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+        if (upvalue->location == &upvalue->closed)
+            ((ObjUpvalue *)copy)->location = &((ObjUpvalue *)copy)->closed;
     }
-    void *res = realloc(ptr, new);
-    if (!res)
+    // an incremental collection may have marked it already
+    if (gc_is_marked(obj)) {
+        u64 mask;
+        *gc_mark_word(copy, &mask) |= mask;
+    }
+    obj->forwarded = true;
+    *forwarding(obj) = copy;
+    graystack_write(&vm.gray_stack, copy);
+    return copy;
+}
+
+// while compacting, old objects can be forwarded too
+static void forward_obj(Obj **ref)
+{
+    Obj *obj = *ref;
+    if (obj == NULL || !(gc_is_young(obj) || compacting))
+        return;
+    if (obj->forwarded)
+        *ref = *forwarding(obj);
+    else if (gc_is_young(obj))
+        *ref = promote(obj);
+}
+
+static void forward_value(Value *value)
+{
+    if (IS_OBJ(*value)) {
+        Obj *obj = AS_OBJ(*value);
+        forward_obj(&obj);
+        *value = VALUE_MKOBJ(obj);
+    }
+}
+
+#define FORWARD(ref) forward_obj((Obj **)(ref))
+
+static void forward_arr(ValueArray *arr)
+{
+    for (size_t i = 0; i < arr->size; i++)
+        forward_value(&arr->values[i]);
+}
+
+static void forward_table(Table *tab)
+{
+    for (size_t i = 0; i < tab->cap; i++) {
+        Entry *entry = &tab->entries[i];
+        FORWARD(&entry->key);
+        forward_value(&entry->value);
+    }
+}
+
+// same edges as mark_black()
+static void forward_fields(Obj *obj)
+{
+    switch (obj->type) {
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    case OBJ_ROPE: {
+        ObjRope *rope = (ObjRope *)obj;
+        FORWARD(&rope->flat);
+        FORWARD(&rope->left);
+        FORWARD(&rope->right);
+        break;
+    }
+    case OBJ_UPVALUE:
+        forward_value(&((ObjUpvalue *)obj)->closed);
+        break;
+    case OBJ_FUNCTION: {
+        ObjFunction *fun = (ObjFunction *)obj;
+        FORWARD(&fun->name);
+        forward_arr(&fun->chunk.constants);
+        for (size_t i = 0; i < fun->chunk.cache_size; i++) {
+            InlineCache *cache = &fun->chunk.caches[i];
+            for (int j = 0; j < cache->size; j++) {
+                CacheEntry *entry = &cache->entries[j];
+                FORWARD(&entry->klass);
+                FORWARD(&entry->shape);
+                FORWARD(&entry->next_shape);
+                forward_value(&entry->method);
+            }
+        }
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure *closure = (ObjClosure *)obj;
+        FORWARD(&closure->fun);
+        for (int i = 0; i < closure->upvalue_count; i++)
+            FORWARD(&closure->upvalues[i]);
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass *klass = (ObjClass *)obj;
+        FORWARD(&klass->name);
+        FORWARD(&klass->init);
+        for (int i = 0; i < klass->method_cap; i++)
+            FORWARD(&klass->methods[i]);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance *inst = (ObjInstance *)obj;
+        FORWARD(&inst->klass);
+        FORWARD(&inst->shape);
+        for (int i = 0; i < inst->shape->slot_count; i++)
+            forward_value(instance_field(inst, i));
+        break;
+    }
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        forward_value(&bound->receiver);
+        FORWARD(&bound->method);
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape *shape = (ObjShape *)obj;
+        FORWARD(&shape->parent);
+        FORWARD(&shape->name);
+        forward_table(&shape->transitions);
+        break;
+    }
+    }
+}
+
+/* the compiler never runs while a minor collection does: they only happen
+ * at the safepoints of the interpreter loop, where the only references
+ * to objects are the ones below. */
+static void forward_roots()
+{
+    for (Value *slot = vm.stack; slot < vm.sp; slot++)
+        forward_value(slot);
+    for (size_t i = 0; i < vm.frame_size; i++)
+        FORWARD(&vm.frames[i].closure);
+    for (ObjUpvalue **upvalue = &vm.open_upvalues; *upvalue != NULL; upvalue = &(*upvalue)->next)
+        FORWARD(upvalue);
+    forward_table(&vm.global_slots);
+    forward_arr(&vm.global_names);
+    forward_arr(&vm.global_values);
+    FORWARD(&vm.init_string);
+    forward_arr(&vm.selectors);
+    FORWARD(&vm.empty_shape);
+    FORWARD(&vm.gc_stats_class);
+    for (size_t i = 0; i < vm.remembered.size; i++) {
+        Obj *obj = vm.remembered.stack[i];
+        obj->remembered = false;
+        forward_fields(obj);
+    }
+    vm.remembered.size = 0;
+}
+
+/* interned strings are weak references: move the table entries of the
+ * promoted ones and drop the rest. dead young objects still own their
+ * out-of-line data, which is freed here. a promoted string has lost its
+ * length to the forwarding address, but not its hash, which is all
+ * table_delete() looks at. */
+static void sweep_nursery()
+{
+    size_t freed = 0;
+    for (u8 *p = vm.nursery.start; p < vm.nursery.top; ) {
+        Obj *obj = (Obj *)p;
+        size_t size = young_size(obj);
+        p += nursery_size(size);
+        if (obj->type == OBJ_STRING && ((ObjString *)obj)->interned) {
+            table_delete(&vm.strings, (ObjString *)obj);
+            if (obj->forwarded)
+                table_install(&vm.strings, (ObjString *)*forwarding(obj), VALUE_MKNIL());
+        }
+        if (!obj->forwarded) {
+            freed += size;
+            // the most common young garbage, and it owns nothing else
+            if (obj->type != OBJ_STRING && obj->type != OBJ_ROPE)
+                obj_free(obj);
+        }
+    }
+    vm.gc_stats.freed_bytes += freed;
+}
+
+/*
+ * compaction moves objects out of sparse pages into the free cells of
+ * fuller ones, after a full collection with an exact sweep. like minor
+ * collections it runs at a safepoint, right after the nursery has been
+ * emptied, so the references to fix are in the roots, in vm.strings and
+ * in the objects of the heap. interned strings keep their hash, so their
+ * entries stay where they are and lookups keep finding a single copy.
+ */
+
+static void relocate(Obj *from, Obj *to)
+{
+    if (from->type == OBJ_UPVALUE) {
+        ObjUpvalue *upvalue = (ObjUpvalue *)from;
+        if (upvalue->location == &upvalue->closed)
+            ((ObjUpvalue *)to)->location = &((ObjUpvalue *)to)->closed;
+    }
+    from->forwarded = true;
+    *forwarding(from) = to;
+}
+
+static void compact()
+{
+    u64 start = now();
+    collecting = true;
+    collect_fully();
+
+    compacting = true;
+    heap_compact(relocate);
+    forward_roots();
+    forward_table(&vm.strings);
+    heap_visit(forward_fields);
+    heap_release_evacuated();
+    compacting = false;
+
+    vm.gc_compact_pending = false;
+    vm.gc_pending = false;
+    vm.gc_debt = 0;
+    vm.gc_stats.compactions++;
+    collecting = false;
+    MAJOR_PAUSE(start);
+}
+
+void gc_collect_young()
+{
+#ifdef DEBUG_LOC_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+
+    u64 start = now();
+    size_t promoted = vm.gc_stats.promoted_bytes;
+    collecting = true;
+
+    // the gray stack can hold objects for incremental marking
+    size_t base = vm.gray_stack.size;
+    forward_roots();
+    while (vm.gray_stack.size > base)
+        forward_fields(vm.gray_stack.stack[--vm.gray_stack.size]);
+    size_t size = 0;
+    for (size_t i = 0; i < base; i++) {
+        Obj *obj = vm.gray_stack.stack[i];
+        if (gc_is_young(obj)) {
+            if (!obj->forwarded)
+                continue;
+            obj = *forwarding(obj);
+        }
+        vm.gray_stack.stack[size++] = obj;
+    }
+    vm.gray_stack.size = size;
+
+    sweep_nursery();
+    vm.nursery.top = vm.nursery.start;
+    memset(vm.nursery.marks, 0, GC_NURSERY_MARKS * sizeof(u64));
+    vm.gc_pending = false;
+    collecting = false;
+    promoted = vm.gc_stats.promoted_bytes - promoted;
+    MINOR_PAUSE(start);
+
+    if (vm.gc_compact_pending) {
+        compact();
+        return;
+    }
+
+#ifdef DEBUG_LOC_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", vm.bytes_allocated - before);
+#endif
+
+    collect_if_needed(promoted);
+}
+
+void gc_remember(Obj *obj)
+{
+    obj->remembered = true;
+    graystack_write(&vm.remembered, obj);
+}
+
+void gc_init()
+{
+    vm.nursery.start = malloc(GC_NURSERY_SIZE);
+    if (!vm.nursery.start)
+        abort();
+    vm.nursery.top = vm.nursery.start;
+    vm.nursery.end = vm.nursery.start + GC_NURSERY_SIZE;
+    vm.nursery.marks = calloc(GC_NURSERY_MARKS, sizeof(u64));
+    if (!vm.nursery.marks)
         abort();
-    return res;
+    vm.gc_pending = false;
+    graystack_init(&vm.remembered);
+    vm.gc_phase = GC_IDLE;
+    vm.gc_incremental = false;
+    vm.gc_threads = 1;
+    vm.gc_compact = false;
+    vm.gc_compact_pending = false;
+    vm.gc_initial_heap = GC_INITIAL_HEAP;
+    vm.gc_grow_factor = 2;
+    vm.gc_max_heap = 0;
+    vm.gc_debt = 0;
+    memset(&vm.gc_stats, 0, sizeof(vm.gc_stats));
+    vm.gc_stats.start_time = now();
+}
+
+void gc_free()
+{
+    stop_markers();
+    NURSERY_FOR_EACH(obj)
+        obj_free(obj);
+    heap_free_all();
+    free(vm.nursery.start);
+    free(vm.nursery.marks);
+    vm.nursery.start = vm.nursery.top = vm.nursery.end = NULL;
+    vm.nursery.marks = NULL;
+    free(vm.remembered.stack);
+}
+
+/* objects go in the nursery when they fit. once it's full they go
+ * straight to the old space until the vm reaches a safepoint and
+ * collects the nursery; they're remembered since whatever gets stored
+ * in them while they're initialized can be young. */
+Obj *gc_alloc_obj(size_t size)
+{
+    Obj *obj;
+    size_t rounded = nursery_size(size);
+    if (size <= GC_LARGE_OBJECT && rounded <= (size_t)(vm.nursery.end - vm.nursery.top)) {
+        obj = (Obj *)vm.nursery.top;
+        vm.nursery.top += rounded;
+        obj->remembered = false;
+        obj->forwarded = false;
+        obj->large = false;
+#ifdef DEBUG_STRESS_GC
+        vm.gc_pending = true;
+#endif
+        return obj;
+    }
+
+    if (size <= GC_LARGE_OBJECT)
+        vm.gc_pending = true;
+    obj = alloc_old(size);
+    gc_remember(obj);
+    return obj;
+}
+
+void *reallocate(void *ptr, size_t old, size_t new)
+{
+    vm.bytes_allocated += new - old;
+
+    // never collect when freeing: sweep() itself frees through here
+    if (new > old && !collecting) {
+#ifdef DEBUG_STRESS_GC
+        gc_collect();
+#endif
+        collect_if_needed(new - old);
+    }
+
+    return pool_realloc(ptr, old, new);
 }
 
 void gc_collect()
@@ -153,11 +930,25 @@ void gc_collect()
     size_t before = vm.bytes_allocated;
 #endif
 
-    mark_roots();
+    /* finishes the sweep of the last collection, or the marking of a
+     * running incremental one. the sweep of this one is done lazily, so
+     * the limit is set from an estimate of the live bytes, plus the
+     * garbage vm.bytes_allocated still counts until it's freed. */
+    u64 start = now();
+    collecting = true;
+    if (vm.gc_phase == GC_SWEEP) {
+        heap_sweep(LONG_MAX);
+        finish_sweep();
+    }
+    if (vm.gc_phase == GC_IDLE)
+        begin_marking();
     trace_refs();
-    remove_whites(&vm.strings);
-    sweep();
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    finish_marking();
+    size_t live = vm.bytes_allocated * live_share;
+    vm.next_gc = next_limit(vm.bytes_allocated + live * (vm.gc_grow_factor - 1));
+    vm.gc_debt = 0;
+    collecting = false;
+    MAJOR_PAUSE(start);
 
 #ifdef DEBUG_LOC_GC
     printf("-- gc end\n");
@@ -166,6 +957,40 @@ void gc_collect()
 #endif
 }
 
+static const char *pause_buckets[GC_PAUSE_BUCKETS] = {
+    "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms",
+};
+
+void gc_print_stats()
+{
+    fflush(stdout);
+    GCStats *stats = &vm.gc_stats;
+    double elapsed = (now() - stats->start_time) / 1e6;
+    double minor = stats->minor_time / 1e6, major = stats->major_time / 1e6;
+    fprintf(stderr, "gc (%s, %d marking thread%s):\n",
+        vm.gc_incremental ? "incremental" : "stop the world",
+        vm.gc_threads, vm.gc_threads == 1 ? "" : "s");
+    fprintf(stderr, "    minor: %zu pauses, %.3f ms total, %.3f ms max\n",
+        stats->minor_pauses, minor, stats->max_minor_pause / 1e6);
+    fprintf(stderr, "    major: %zu pauses, %.3f ms total, %.3f ms max\n",
+        stats->major_pauses, major, stats->max_major_pause / 1e6);
+    fprintf(stderr, "    collections: %zu full, %.3f MB freed, %.3f MB promoted\n",
+        stats->collections, stats->freed_bytes / 1e6, stats->promoted_bytes / 1e6);
+    if (vm.gc_compact)
+        fprintf(stderr, "    compactions: %zu\n", stats->compactions);
+    fprintf(stderr, "    pauses:");
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+        fprintf(stderr, " %s %zu", pause_buckets[i], stats->pause_histogram[i]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    heap: %.3f MB, next collection at %.3f MB",
+        vm.bytes_allocated / 1e6, vm.next_gc / 1e6);
+    if (vm.gc_max_heap > 0)
+        fprintf(stderr, ", at most %.3f MB", vm.gc_max_heap / 1e6);
+    fprintf(stderr, " (grow factor %g)\n", vm.gc_grow_factor);
+    fprintf(stderr, "    overhead: %.1f%% of %.3f ms\n",
+        elapsed > 0 ? (minor + major) / elapsed * 100 : 0.0, elapsed);
+}
+
 void gc_mark_table(Table *tab)
 {
     // TABLE_FOR_EACH(tab, entry) {
@@ -187,7 +1012,19 @@ void gc_mark_value(Value value)
 
 void gc_mark_obj(Obj *obj)
 {
-    if (obj == NULL || obj->marked)
+    if (obj == NULL)
+        return;
+    u64 mask;
+    u64 *word = gc_mark_word(obj, &mask);
+    if (marker != NULL) {
+        // other threads are setting bits in the same words
+        if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask)
+         || (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask))
+            return;
+        deque_push(marker, obj);
+        return;
+    }
+    if (*word & mask)
         return;
 
 #ifdef DEBUG_LOC_GC
@@ -196,6 +1033,6 @@ void gc_mark_obj(Obj *obj)
     printf("\n");
 #endif
 
-    obj->marked = true;
+    *word |= mask;
     graystack_write(&vm.gray_stack, obj);
 }
@@ -4,13 +4,82 @@
 #include <stddef.h>
 #include "value.h"
 #include "table.h"
+#include "vm.h"
+#include "heap.h"
+
+#define GC_NURSERY_GRANULE 8
 
 void *reallocate(void *ptr, size_t old, size_t new);
+void gc_init();
+void gc_free();
+Obj *gc_alloc_obj(size_t size);
 void gc_collect();
+void gc_collect_young();
+void gc_remember(Obj *obj);
+void gc_print_stats();
 void gc_mark_value(Value value);
 void gc_mark_obj(Obj *obj);
 void gc_mark_table(Table *tab);
 
+static inline bool gc_is_young(Obj *obj)
+{
+    return (u8 *)obj >= vm.nursery.start && (u8 *)obj < vm.nursery.end;
+}
+
+// finds the mark bit of an object, wherever it lives
+static inline u64 *gc_mark_word(Obj *obj, u64 *mask)
+{
+    u64 *bitmap;
+    size_t bit;
+    if (gc_is_young(obj)) {
+        bitmap = vm.nursery.marks;
+        bit = ((u8 *)obj - vm.nursery.start) / GC_NURSERY_GRANULE;
+    } else if (obj->large) {
+        *mask = 1;
+        return &heap_large(obj)->marks;
+    } else {
+        bitmap = heap_page(obj)->marks;
+        bit = heap_bit(obj);
+    }
+    *mask = (u64)1 << (bit % 64);
+    return &bitmap[bit / 64];
+}
+
+static inline bool gc_is_marked(Obj *obj)
+{
+    u64 mask;
+    return (*gc_mark_word(obj, &mask) & mask) != 0;
+}
+
+/*
+ * write barrier, to be called after storing value inside owner.
+ * minor collections don't trace the old space, so an old object that
+ * gets a reference to a young one is remembered and treated as a root.
+ * while an incremental collection is marking, a marked object can't be
+ * left pointing to an unmarked one, so the stored object gets marked
+ * (a dijkstra-style barrier).
+ */
+static inline void gc_write_barrier(Obj *owner, Value value)
+{
+    if (!IS_OBJ(value))
+        return;
+    Obj *obj = AS_OBJ(value);
+    if (vm.gc_phase == GC_MARK && gc_is_marked(owner) && !gc_is_marked(obj))
+        gc_mark_obj(obj);
+    if (gc_is_young(obj) && !owner->remembered && !gc_is_young(owner))
+        gc_remember(owner);
+}
+
+/* for stores that can't be checked one by one, like copying a table:
+ * the owner is remembered, and traced again if it was already marked. */
+static inline void gc_write_barrier_all(Obj *owner)
+{
+    if (vm.gc_phase == GC_MARK && gc_is_marked(owner))
+        graystack_write(&vm.gray_stack, owner);
+    if (!owner->remembered && !gc_is_young(owner))
+        gc_remember(owner);
+}
+
 #define ALLOCATE(type, count) \
     (type *) reallocate(NULL, 0, sizeof(type) * (count))
 
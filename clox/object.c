@@ -1,63 +1,111 @@
 #include "object.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "memory.h"
 #include "table.h"
 #include "vm.h"
 #include "debug.h"
+#include "jit.h"
+#include "profile.h"
 
-static const char *type_tostring(ObjType type)
+const char *obj_type_name(ObjType type)
 {
     switch (type) {
-    case OBJ_STRING:   return "ObjString";
-    case OBJ_FUNCTION: return "ObjFunction";
-    case OBJ_NATIVE:   return "ObjNative";
-    case OBJ_CLOSURE:  return "ObjClosure";
-    case OBJ_UPVALUE:  return "ObjUpvalue";
-    default: return "NoType";
+    case OBJ_STRING:        return "string";
+    case OBJ_ROPE:          return "rope";
+    case OBJ_FUNCTION:      return "function";
+    case OBJ_NATIVE:        return "native";
+    case OBJ_UPVALUE:       return "upvalue";
+    case OBJ_CLOSURE:       return "closure";
+    case OBJ_CLASS:         return "class";
+    case OBJ_INSTANCE:      return "instance";
+    case OBJ_BOUND_METHOD:  return "bound method";
+    case OBJ_SHAPE:         return "shape";
     }
+    return "unknown";
 }
 
 static Obj *alloc_obj(size_t size, ObjType type)
 {
-    Obj *obj = reallocate(NULL, 0, size);
+    Obj *obj = gc_alloc_obj(size);
     obj->type = type;
-    obj->marked = false;
-    obj->next = vm.objects;
-    vm.objects = obj;
+    profile_alloc(type, size);
 
 #ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for %s\n", (void *) obj, size, type_tostring(type));
+    printf("%p allocate %zu for %s\n", (void *) obj, size, obj_type_name(type));
 #endif
 
     return obj;
 }
 
+static size_t instance_size(int inline_cap)
+{
+    return sizeof(ObjInstance) + sizeof(Value) * inline_cap;
+}
+
 #define ALLOCATE_OBJ(type, obj_type) \
     (type *) alloc_obj(sizeof(type), obj_type)
 
-static ObjString *alloc_str(char *data, size_t len, u32 hash)
+// concatenations shorter than this are copied right away
+#define ROPE_MIN_LEN 256
+
+static size_t string_size(size_t len)
+{
+    return offsetof(ObjString, data) + len + 1;
+}
+
+// a string that isn't interned yet, with room for len characters
+static ObjString *alloc_str(size_t len)
+{
+    ObjString *str = (ObjString *)alloc_obj(string_size(len), OBJ_STRING);
+    str->len = len;
+    str->selector = -1;
+    str->interned = false;
+    str->data[len] = '\0';
+    return str;
+}
+
+static ObjString *intern_str(ObjString *str, u32 hash)
 {
-    ObjString *str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    str->len  = len;
-    str->data = data;
     str->hash = hash;
+    str->interned = true;
     vm_push(VALUE_MKOBJ(str));
     table_install(&vm.strings, str, VALUE_MKNIL());
     vm_pop();
     return str;
 }
 
-// algorithm: FNV-1a
+static u64 rotl(u64 x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+/* eight bytes at a time, each word mixed in with a rotate and a multiply,
+ * then murmur3's finalizer so that the low bits the tables use depend on
+ * all of them. */
 static u32 hash_string(const char *str, size_t len)
 {
-    u32 hash = 2166136261u;
-    for (size_t i = 0; i < len; i++) {
-        hash ^= (u8) str[i];
-        hash *= 16777619;
+    const u64 k = 0x517cc1b727220a95ull;
+    u64 hash = len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        u64 word;
+        memcpy(&word, str + i, 8);
+        hash = (rotl(hash, 5) ^ word) * k;
+    }
+    if (i < len) {
+        u64 word = 0;
+        memcpy(&word, str + i, len - i);
+        hash = (rotl(hash, 5) ^ word) * k;
     }
-    return hash;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return (u32)hash;
 }
 
 static void print_function(ObjFunction *fun)
@@ -71,27 +119,133 @@ static void print_function(ObjFunction *fun)
 
 
 
+size_t obj_size(Obj *obj)
+{
+    switch (obj->type) {
+    case OBJ_STRING:        return string_size(((ObjString *)obj)->len);
+    case OBJ_ROPE:          return sizeof(ObjRope);
+    case OBJ_FUNCTION:      return sizeof(ObjFunction);
+    case OBJ_NATIVE:        return sizeof(ObjNative);
+    case OBJ_UPVALUE:       return sizeof(ObjUpvalue);
+    case OBJ_CLOSURE:       return sizeof(ObjClosure);
+    case OBJ_CLASS:         return sizeof(ObjClass);
+    case OBJ_INSTANCE:      return instance_size(((ObjInstance *)obj)->inline_cap);
+    case OBJ_BOUND_METHOD:  return sizeof(ObjBoundMethod);
+    case OBJ_SHAPE:         return sizeof(ObjShape);
+    }
+    return 0;
+}
+
 ObjString *obj_copy_string(const char *str, size_t len)
 {
     u32 hash = hash_string(str, len);
     ObjString *interned = table_find_string(&vm.strings, str, len, hash);
     if (interned != NULL)
         return interned;
-    char *newstr = ALLOCATE(char, len + 1);
-    memcpy(newstr, str, len);
-    newstr[len] = '\0';
-    return alloc_str(newstr, len, hash);
+    ObjString *copy = alloc_str(len);
+    memcpy(copy->data, str, len);
+    return intern_str(copy, hash);
 }
 
-ObjString *obj_take_string(char *data, size_t len)
+static size_t text_len(Obj *text)
 {
-    u32 hash = hash_string(data, len);
-    ObjString *interned = table_find_string(&vm.strings, data, len, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, data, len + 1);
-        return interned;
+    return text->type == OBJ_STRING ? ((ObjString *)text)->len
+                                    : ((ObjRope *)text)->len;
+}
+
+/* short results are copied into a new string, which isn't interned:
+ * most of them are printed or thrown away, and never looked up. longer
+ * ones become ropes, so that building a long string a piece at a time
+ * doesn't copy it over and over. */
+Obj *obj_concat(Obj *a, Obj *b)
+{
+    size_t len = text_len(a) + text_len(b);
+    if (len < ROPE_MIN_LEN) {
+        // both are too short to be ropes
+        ObjString *x = (ObjString *)a, *y = (ObjString *)b;
+        ObjString *str = alloc_str(len);
+        memcpy(str->data,          x->data, x->len);
+        memcpy(str->data + x->len, y->data, y->len);
+        return (Obj *)str;
+    }
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->len   = len;
+    rope->flat  = NULL;
+    rope->left  = a;
+    rope->right = b;
+    return (Obj *)rope;
+}
+
+/* the pieces are copied from the last one back, with an explicit stack:
+ * a string built by appending is a rope as deep as it is long. */
+static void copy_rope(ObjRope *rope, char *end)
+{
+    Obj *local[64];
+    Obj **pending = local;
+    size_t size = 0, cap = 64;
+    pending[size++] = (Obj *)rope;
+    while (size > 0) {
+        Obj *piece = pending[--size];
+        if (piece->type == OBJ_ROPE && ((ObjRope *)piece)->flat != NULL)
+            piece = (Obj *)((ObjRope *)piece)->flat;
+        if (piece->type == OBJ_STRING) {
+            ObjString *str = (ObjString *)piece;
+            end -= str->len;
+            memcpy(end, str->data, str->len);
+            continue;
+        }
+        if (size + 2 > cap) {
+            Obj **grown = malloc(sizeof(Obj *) * cap * 2);
+            if (grown == NULL)
+                abort();
+            memcpy(grown, pending, sizeof(Obj *) * size);
+            if (pending != local)
+                free(pending);
+            pending = grown;
+            cap *= 2;
+        }
+        pending[size++] = ((ObjRope *)piece)->left;
+        pending[size++] = ((ObjRope *)piece)->right;
     }
-    return alloc_str(data, len, hash);
+    if (pending != local)
+        free(pending);
+}
+
+/* the characters of a string or a rope, as a string. the rope keeps the
+ * result and lets go of its halves, which can be collected if nothing
+ * else uses them. */
+ObjString *obj_flatten(Obj *text)
+{
+    if (text->type == OBJ_STRING)
+        return (ObjString *)text;
+    ObjRope *rope = (ObjRope *)text;
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    vm_push(VALUE_MKOBJ(rope));
+    ObjString *str = alloc_str(rope->len);
+    copy_rope(rope, str->data + rope->len);
+    rope->flat  = str;
+    rope->left  = NULL;
+    rope->right = NULL;
+    gc_write_barrier((Obj *)rope, VALUE_MKOBJ(str));
+    vm_pop();
+    return str;
+}
+
+/* two interned strings are equal only if they are the same object, the
+ * others have to compare their characters. a rope is flattened first,
+ * unless the lengths already tell the two apart. the caller keeps a and
+ * b reachable. */
+bool obj_text_equal(Value a, Value b)
+{
+    if (!IS_TEXT(a) || !IS_TEXT(b) || text_len(AS_OBJ(a)) != text_len(AS_OBJ(b)))
+        return false;
+    ObjString *x = obj_flatten(AS_OBJ(a));
+    ObjString *y = obj_flatten(AS_OBJ(b));
+    if (x == y || (x->interned && y->interned))
+        return x == y;
+    return memcmp(x->data, y->data, x->len) == 0;
 }
 
 ObjFunction *obj_make_fun()
@@ -99,7 +253,10 @@ ObjFunction *obj_make_fun()
     ObjFunction *fun = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     fun->arity = 0;
     fun->upvalue_count = 0;
+    fun->max_stack = 0;
     fun->name = NULL;
+    fun->jit = NULL;
+    fun->jit_countdown = vm.jit ? JIT_THRESHOLD : 0;
     chunk_init(&fun->chunk);
     return fun;
 }
@@ -137,15 +294,70 @@ ObjClass *obj_make_class(ObjString *name)
 {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
-    table_init(&klass->methods);
+    klass->init = NULL;
+    klass->methods = NULL;
+    klass->method_base = 0;
+    klass->method_cap = 0;
+    klass->field_hint = 0;
     return klass;
 }
 
+static int selector_of(ObjString *name)
+{
+    if (name->selector == -1) {
+        // the name has to outlive the classes that use its selector
+        valuearray_write(&vm.selectors, VALUE_MKOBJ(name));
+        name->selector = vm.selectors.size - 1;
+    }
+    return name->selector;
+}
+
+void class_add_method(ObjClass *klass, ObjString *name, ObjClosure *method)
+{
+    int selector = selector_of(name);
+    int end = klass->method_base + klass->method_cap;
+    if (klass->method_cap == 0 || selector < klass->method_base || selector >= end) {
+        int base = klass->method_cap == 0 || selector < klass->method_base ? selector : klass->method_base;
+        int cap  = (klass->method_cap == 0 || selector >= end ? selector + 1 : end) - base;
+        ObjClosure **methods = ALLOCATE(ObjClosure *, cap);
+        for (int i = 0; i < cap; i++)
+            methods[i] = NULL;
+        for (int i = 0; i < klass->method_cap; i++)
+            methods[klass->method_base - base + i] = klass->methods[i];
+        FREE_ARRAY(ObjClosure *, klass->methods, klass->method_cap);
+        klass->methods = methods;
+        klass->method_base = base;
+        klass->method_cap = cap;
+    }
+    klass->methods[selector - klass->method_base] = method;
+    if (name == vm.init_string)
+        klass->init = method;
+    gc_write_barrier((Obj *)klass, VALUE_MKOBJ(method));
+}
+
+// the class must not have methods of its own yet
+void class_inherit(ObjClass *klass, ObjClass *superclass)
+{
+    ObjClosure **methods = ALLOCATE(ObjClosure *, superclass->method_cap);
+    memcpy(methods, superclass->methods, sizeof(ObjClosure *) * superclass->method_cap);
+    FREE_ARRAY(ObjClosure *, klass->methods, klass->method_cap);
+    klass->methods = methods;
+    klass->method_base = superclass->method_base;
+    klass->method_cap = superclass->method_cap;
+    klass->init = superclass->init;
+    gc_write_barrier_all((Obj *)klass);
+}
+
 ObjInstance *obj_make_instance(ObjClass *klass)
 {
-    ObjInstance *inst = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    inst->klass = klass;
-    table_init(&inst->fields);
+    int inline_cap = klass->field_hint;
+    ObjInstance *inst = (ObjInstance *) alloc_obj(instance_size(inline_cap),
+                                                  OBJ_INSTANCE);
+    inst->klass        = klass;
+    inst->shape        = vm.empty_shape;
+    inst->extra_fields = NULL;
+    inst->extra_cap    = 0;
+    inst->inline_cap   = inline_cap;
     return inst;
 }
 
@@ -157,10 +369,69 @@ ObjBoundMethod *obj_make_bound_method(Value receiver, ObjClosure *method)
     return bound;
 }
 
+ObjShape *obj_make_shape(ObjShape *parent, ObjString *name)
+{
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent     = parent;
+    shape->name       = name;
+    shape->slot_count = parent == NULL ? 0 : parent->slot_count + 1;
+    table_init(&shape->transitions);
+    if (parent != NULL) {
+        vm_push(VALUE_MKOBJ(shape));
+        table_install(&parent->transitions, name, VALUE_MKOBJ(shape));
+        gc_write_barrier_all((Obj *)parent);
+        vm_pop();
+    }
+    return shape;
+}
+
+int shape_find_slot(ObjShape *shape, ObjString *name)
+{
+    for (ObjShape *s = shape; s->parent != NULL; s = s->parent)
+        if (s->name == name)
+            return s->slot_count - 1;
+    return -1;
+}
+
+/* return the shape reached from shape by adding a field called name,
+ * creating it the first time the transition is taken. */
+ObjShape *shape_add_field(ObjShape *shape, ObjString *name)
+{
+    Value next;
+    if (table_lookup(&shape->transitions, name, &next))
+        return AS_SHAPE(next);
+    return obj_make_shape(shape, name);
+}
+
+void instance_add_field(ObjInstance *inst, ObjShape *shape, Value value)
+{
+    int slot = shape->slot_count - 1;
+    if (slot >= inst->inline_cap) {
+        int extra = slot - inst->inline_cap;
+        if (extra >= inst->extra_cap) {
+            int old = inst->extra_cap;
+            inst->extra_cap = vector_grow_cap(old);
+            inst->extra_fields = GROW_ARRAY(Value, inst->extra_fields, old,
+                                            inst->extra_cap);
+        }
+    }
+    *instance_field(inst, slot) = value;
+    inst->shape = shape;
+    gc_write_barrier((Obj *)inst, value);
+    gc_write_barrier((Obj *)inst, VALUE_MKOBJ(shape));
+    if (shape->slot_count > inst->klass->field_hint)
+        inst->klass->field_hint = shape->slot_count;
+}
+
 void obj_print(Value value)
 {
     switch (OBJ_TYPE(value)) {
     case OBJ_STRING: printf("%.*s", (int) AS_STRING(value)->len, AS_STRING(value)->data); break;
+    case OBJ_ROPE: {
+        ObjString *str = obj_flatten(AS_OBJ(value));
+        printf("%.*s", (int) str->len, str->data);
+        break;
+    }
     case OBJ_FUNCTION: print_function(AS_FUNCTION(value)); break;
     case OBJ_NATIVE: printf("<native fn '%s'>", ((ObjNative *)AS_OBJ(value))->name); break;
     case OBJ_CLOSURE: print_function(AS_CLOSURE(value)->fun); break;
@@ -176,64 +447,47 @@ void obj_print(Value value)
         printf(">");
         break;
     case OBJ_BOUND_METHOD: print_function(AS_BOUND_METHOD(value)->method->fun); break;
+    case OBJ_SHAPE: printf("shape"); break;
     }
 }
 
 void obj_free(Obj *obj)
 {
 #ifdef DEBUG_LOC_GC
-    printf("%p free type %s\n", (void *)obj, type_tostring(obj->type));
+    printf("%p free type %s\n", (void *)obj, obj_type_name(obj->type));
 #endif
 
     switch (obj->type) {
-    case OBJ_STRING: {
-        ObjString *str = (ObjString *)obj;
-        FREE_ARRAY(char, str->data, str->len+1);
-        FREE(ObjString, obj);
-        break;
-    }
-    case OBJ_FUNCTION: {
-        ObjFunction *fun = (ObjFunction *)obj;
-        chunk_free(&fun->chunk);
-        FREE(ObjFunction, obj);
-        break;
-    }
-    case OBJ_NATIVE:
-        FREE(ObjNative, obj);
+    case OBJ_FUNCTION:
+        chunk_free(&((ObjFunction *)obj)->chunk);
+        jit_free(((ObjFunction *)obj)->jit);
         break;
     case OBJ_CLOSURE: {
         ObjClosure *closure = (ObjClosure *)obj;
         FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalue_count);
-        FREE(ObjClosure, obj);
         break;
     }
-    case OBJ_UPVALUE:
-        FREE(ObjUpvalue, obj);
-        break;
     case OBJ_CLASS: {
         ObjClass *klass = (ObjClass *)obj;
-        table_free(&klass->methods);
-        FREE(ObjClass, obj);
+        FREE_ARRAY(ObjClosure *, klass->methods, klass->method_cap);
         break;
     }
     case OBJ_INSTANCE: {
         ObjInstance *inst = (ObjInstance *)obj;
-        table_free(&inst->fields);
-        FREE(ObjInstance, obj);
+        FREE_ARRAY(Value, inst->extra_fields, inst->extra_cap);
         break;
     }
-    case OBJ_BOUND_METHOD:
-        FREE(ObjBoundMethod, obj);
+    case OBJ_SHAPE: {
+        ObjShape *shape = (ObjShape *)obj;
+        table_free(&shape->transitions);
         break;
     }
-}
-
-void obj_free_arr(Obj *objects)
-{
-    Obj *obj = objects;
-    while (obj != NULL) {
-        Obj *next = obj->next;
-        obj_free(obj);
-        obj = next;
+    case OBJ_STRING:
+    case OBJ_ROPE:
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+    case OBJ_BOUND_METHOD:
+        break;
     }
+    // the memory of the object itself belongs to the heap or the nursery
 }
@@ -9,6 +9,7 @@
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_UPVALUE,
@@ -16,27 +17,55 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
 } ObjType;
 
+/* mark bits live in the heap's side bitmaps, see heap.h. a promoted young
+ * object keeps the address of its copy right after the header. */
 struct Obj {
     ObjType type;
-    bool marked;
-    struct Obj *next;
+    bool remembered;
+    bool forwarded;
+    bool large;
 };
 
+/* the characters follow the header, nul-terminated. the length comes
+ * first: it's what a young string loses to its forwarding address, and
+ * obj_size() finds it in the copy then.
+ * names and literals are interned, so the compiler and the tables can
+ * tell them apart by address. strings made while the program runs are
+ * compared by their characters instead, and have no hash. */
 struct ObjString {
     Obj obj;
     size_t len;
-    char *data;
     u32 hash;
+    int selector;   // -1 if no class has a method with this name
+    bool interned;
+    char data[];
 };
 
+/* the result of a concatenation too long to copy right away. its halves
+ * are strings or other ropes; the characters are put together the first
+ * time they're needed, into a plain string that replaces them. like any
+ * string made at run time it isn't interned, so it's compared by its
+ * characters. */
+typedef struct {
+    Obj obj;
+    size_t len;
+    ObjString *flat;    // NULL until then
+    Obj *left;
+    Obj *right;
+} ObjRope;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalue_count;
+    int max_stack;      // stack slots a call needs, see chunk_max_stack()
     Chunk chunk;
     ObjString *name;
+    struct JitCode *jit;    // NULL until the function gets hot, see jit.h
+    int jit_countdown;      // calls and loop iterations left until then
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argc, Value *argv);
@@ -61,16 +90,50 @@ typedef struct {
     int upvalue_count;
 } ObjClosure;
 
-typedef struct {
+/*
+ * every method name gets a selector, a number, the first time a class
+ * defines a method with it. a class keeps its methods in an array indexed
+ * by selector, from the lowest of them to the highest, and NULL where it
+ * has no method. subclasses start with a copy of their superclass's.
+ */
+struct ObjClass {
     Obj obj;
     ObjString *name;
-    Table methods;
-} ObjClass;
+    ObjClosure *init;       // the constructor, if there is one
+    ObjClosure **methods;
+    int method_base;        // selector of methods[0]
+    int method_cap;
+    int field_hint; // how many fields instances end up having, at most
+};
+
+/*
+ * a shape describes the layout of an instance's fields: which names it
+ * has and in which slot each one lives. shapes form a tree rooted at
+ * vm.empty_shape, where each child adds one field to its parent, so
+ * instances that get the same fields in the same order share a shape.
+ * a shape only knows its own field, which lives in slot slot_count - 1;
+ * the others are found by walking up to the root.
+ */
+struct ObjShape {
+    Obj obj;
+    ObjShape *parent;
+    ObjString *name;    // field added on top of parent
+    int slot_count;
+    Table transitions;  // name -> child shape
+};
 
+/*
+ * fields are stored in the slots given by the shape. the first inline_cap
+ * of them live right after the instance, the others in extra_fields.
+ */
 typedef struct {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape;
+    Value *extra_fields;
+    int extra_cap;
+    int inline_cap;
+    Value fields[];
 } ObjInstance;
 
 typedef struct {
@@ -86,34 +149,66 @@ static inline bool obj_is_type(Value value, ObjType type)
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+// ropes are strings too, as far as the language is concerned
+static inline bool obj_is_text(Value value)
+{
+    return IS_OBJ(value) && (OBJ_TYPE(value) == OBJ_STRING || OBJ_TYPE(value) == OBJ_ROPE);
+}
+
 #define IS_STRING(value)        obj_is_type((value), OBJ_STRING)
+#define IS_ROPE(value)          obj_is_type((value), OBJ_ROPE)
+#define IS_TEXT(value)          obj_is_text(value)
 #define IS_FUNCTION(value)      obj_is_type((value), OBJ_FUNCTION)
 #define IS_NATIVE(value)        obj_is_type((value), OBJ_NATIVE)
 #define IS_CLOSURE(value)       obj_is_type((value), OBJ_CLOSURE)
 #define IS_CLASS(value)         obj_is_type((value), OBJ_CLASS)
 #define IS_INSTANCE(value)      obj_is_type((value), OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)  obj_is_type((value), OBJ_BOUND_METHOD)
+#define IS_SHAPE(value)         obj_is_type((value), OBJ_SHAPE)
 
 #define AS_STRING(value)        ((ObjString *)   AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString *)  AS_OBJ(value))->data)
+#define AS_ROPE(value)          ((ObjRope *)     AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction *) AS_OBJ(value))
 #define AS_NATIVE(value)        (((ObjNative *)  AS_OBJ(value))->fun)
 #define AS_CLOSURE(value)       ((ObjClosure *)  AS_OBJ(value))
 #define AS_CLASS(value)         ((ObjClass *)    AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance *) AS_OBJ(value))
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod *) AS_OBJ(value))
+#define AS_SHAPE(value)         ((ObjShape *)    AS_OBJ(value))
+
+static inline ObjClosure *class_method(ObjClass *klass, ObjString *name)
+{
+    unsigned i = (unsigned)(name->selector - klass->method_base);
+    return name->selector >= 0 && i < (unsigned)klass->method_cap ? klass->methods[i] : NULL;
+}
+
+static inline Value *instance_field(ObjInstance *inst, int slot)
+{
+    return slot < inst->inline_cap ? &inst->fields[slot]
+                                   : &inst->extra_fields[slot - inst->inline_cap];
+}
 
+const char *obj_type_name(ObjType type);
+size_t obj_size(Obj *obj);
 ObjString *obj_copy_string(const char *str, size_t len);
-ObjString *obj_take_string(char *data, size_t len);
+Obj *obj_concat(Obj *a, Obj *b);
+ObjString *obj_flatten(Obj *text);
+bool obj_text_equal(Value a, Value b);
 ObjFunction *obj_make_fun();
 ObjNative *obj_make_native(NativeFn fun, const char *name);
 ObjUpvalue *obj_make_upvalue(Value *slot);
 ObjClosure *obj_make_closure(ObjFunction *fun);
 ObjClass *obj_make_class(ObjString *name);
+void class_add_method(ObjClass *klass, ObjString *name, ObjClosure *method);
+void class_inherit(ObjClass *klass, ObjClass *superclass);
 ObjInstance *obj_make_instance(ObjClass *klass);
 ObjBoundMethod *obj_make_bound_method(Value receiver, ObjClosure *method);
+ObjShape *obj_make_shape(ObjShape *parent, ObjString *name);
+int shape_find_slot(ObjShape *shape, ObjString *name);
+ObjShape *shape_add_field(ObjShape *shape, ObjString *name);
+void instance_add_field(ObjInstance *inst, ObjShape *shape, Value value);
 void obj_print(Value value);
 void obj_free(Obj *obj);
-void obj_free_arr(Obj *objects);
 
 #endif
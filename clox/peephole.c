@@ -0,0 +1,291 @@
+#include "peephole.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "uint.h"
+#include "object.h"
+
+/*
+ * peephole pass run over every chunk once the compiler is done with it.
+ * it replaces short, common instruction sequences with a single
+ * superinstruction, which saves a dispatch (and usually a push and a pop)
+ * for each instruction folded away.
+ * a sequence is only fused when no branch lands in the middle of it.
+ * the chunk is rebuilt in place: fused code is never longer than the
+ * original, branch offsets are recomputed and every byte of a fused
+ * instruction gets the line of the first instruction it replaces.
+ */
+
+typedef enum {
+    FUSE_GET_LOCAL2,
+    FUSE_INC_LOCAL,
+    FUSE_NOT_EQ,
+    FUSE_LESS_EQ,
+    FUSE_GREATER_EQ,
+    FUSE_BRANCH_NOT_LESS,
+    FUSE_BRANCH_NOT_GREATER,
+    FUSE_BRANCH_NOT_LESS_EQ,
+    FUSE_BRANCH_NOT_GREATER_EQ,
+    FUSE_COUNT,
+} Fusion;
+
+static struct {
+    const char *from;
+    const char *to;
+    size_t count;
+} fusions[FUSE_COUNT] = {
+    [FUSE_GET_LOCAL2]            = { "ldl ldl",             "ldl2" },
+    [FUSE_INC_LOCAL]             = { "ldl ldc add stl pop", "incl" },
+    [FUSE_NOT_EQ]                = { "cme not",             "cmne" },
+    [FUSE_LESS_EQ]               = { "cmg not",             "cmle" },
+    [FUSE_GREATER_EQ]            = { "cml not",             "cmge" },
+    [FUSE_BRANCH_NOT_LESS]       = { "cml bfl pop",         "bnl"  },
+    [FUSE_BRANCH_NOT_GREATER]    = { "cmg bfl pop",         "bng"  },
+    [FUSE_BRANCH_NOT_LESS_EQ]    = { "cmg not bfl pop",     "bnle" },
+    [FUSE_BRANCH_NOT_GREATER_EQ] = { "cml not bfl pop",     "bnge" },
+};
+
+typedef struct {
+    Chunk *chunk;
+    size_t *starts;     // offset of every instruction
+    size_t count;
+    int *targets;       // number of branches landing on each offset
+    bool *dead;         // instructions no longer reachable after fusing
+} Code;
+
+// an instruction of the rewritten chunk
+typedef struct {
+    size_t from;        // offset of the first instruction it replaces
+    size_t size;        // how many bytes of the old code it replaces
+    bool copy;          // copied unchanged from the old code
+    u8 code[3];         // opcode and operands, if not copied
+    u8 len;
+    long target;        // old offset of the branch target, -1 if none
+} Instr;
+
+// scratch memory for the pass. like the rest of the vm, it gives up when
+// there's none left.
+static void *check_alloc(void *ptr)
+{
+    if (!ptr)
+        abort();
+    return ptr;
+}
+
+static u8 op_at(Code *c, size_t i)      { return c->chunk->code[c->starts[i]]; }
+static u8 operand(Code *c, size_t i)    { return c->chunk->code[c->starts[i] + 1]; }
+
+// index of the instruction starting at offset
+static size_t find_instr(Code *c, size_t offset)
+{
+    size_t lo = 0, hi = c->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->starts[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bool matches(Code *c, size_t i, const u8 *ops, size_t len)
+{
+    if (i + len > c->count)
+        return false;
+    for (size_t k = 0; k < len; k++) {
+        if (op_at(c, i + k) != ops[k])
+            return false;
+        if (k > 0 && c->targets[c->starts[i + k]] > 0)
+            return false;
+    }
+    return true;
+}
+
+#define MATCH(c, i, ...) \
+    matches(c, i, (const u8[]){ __VA_ARGS__ }, sizeof((const u8[]){ __VA_ARGS__ }))
+
+/*
+ * a condition compiles to a test followed by a branch-if-false and a pop,
+ * with another pop waiting at the branch target, right after the
+ * unconditional branch that ends the then-branch (or the loop body).
+ * a compare-and-branch pops the operands itself, so it can branch past
+ * that second pop, which becomes dead as long as nothing else jumps to it.
+ */
+static bool fuse_branch(Code *c, size_t i, size_t len, u8 op, Fusion kind, Instr *instr)
+{
+    size_t branch = i + len - 2;
+    long target = chunk_branch_target(c->chunk, c->starts[branch]);
+    size_t t = find_instr(c, target);
+    if (t >= c->count || c->starts[t] != (size_t)target || t == 0
+     || op_at(c, t) != OP_POP || c->targets[target] != 1)
+        return false;
+    u8 prev = op_at(c, t - 1);
+    if (prev != OP_BRANCH && prev != OP_BRANCH_BACK && prev != OP_RETURN)
+        return false;
+    c->dead[t] = true;
+    instr->code[0] = op;
+    instr->len = 3;
+    instr->target = target + 1;
+    fusions[kind].count++;
+    return true;
+}
+
+static bool fuse(Code *c, size_t i, Instr *instr, size_t *len)
+{
+    Chunk *chunk = c->chunk;
+
+#define FUSE(n, op, kind)                   \
+    do {                                    \
+        *len = n;                           \
+        instr->code[0] = op;                \
+        instr->len = 1;                     \
+        fusions[kind].count++;              \
+        return true;                        \
+    } while (0)
+
+    if (MATCH(c, i, OP_LESS, OP_BRANCH_FALSE, OP_POP)
+     && fuse_branch(c, i, *len = 3, OP_BRANCH_NOT_LESS, FUSE_BRANCH_NOT_LESS, instr))
+        return true;
+    if (MATCH(c, i, OP_GREATER, OP_BRANCH_FALSE, OP_POP)
+     && fuse_branch(c, i, *len = 3, OP_BRANCH_NOT_GREATER, FUSE_BRANCH_NOT_GREATER, instr))
+        return true;
+    if (MATCH(c, i, OP_GREATER, OP_NOT, OP_BRANCH_FALSE, OP_POP)
+     && fuse_branch(c, i, *len = 4, OP_BRANCH_NOT_LESS_EQ, FUSE_BRANCH_NOT_LESS_EQ, instr))
+        return true;
+    if (MATCH(c, i, OP_LESS, OP_NOT, OP_BRANCH_FALSE, OP_POP)
+     && fuse_branch(c, i, *len = 4, OP_BRANCH_NOT_GREATER_EQ, FUSE_BRANCH_NOT_GREATER_EQ, instr))
+        return true;
+
+    // x = x + k, for a local x and a number k, as a statement
+    if (MATCH(c, i, OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP)
+     && operand(c, i) == operand(c, i + 3)
+     && IS_NUM(chunk->constants.values[operand(c, i + 1)])) {
+        *len = 5;
+        instr->code[0] = OP_INC_LOCAL;
+        instr->code[1] = operand(c, i);
+        instr->code[2] = operand(c, i + 1);
+        instr->len = 3;
+        fusions[FUSE_INC_LOCAL].count++;
+        return true;
+    }
+
+    if (MATCH(c, i, OP_EQ, OP_NOT))         FUSE(2, OP_NOT_EQ,     FUSE_NOT_EQ);
+    if (MATCH(c, i, OP_GREATER, OP_NOT))    FUSE(2, OP_LESS_EQ,    FUSE_LESS_EQ);
+    if (MATCH(c, i, OP_LESS, OP_NOT))       FUSE(2, OP_GREATER_EQ, FUSE_GREATER_EQ);
+
+    if (MATCH(c, i, OP_GET_LOCAL, OP_GET_LOCAL)) {
+        *len = 2;
+        instr->code[0] = OP_GET_LOCAL2;
+        instr->code[1] = operand(c, i);
+        instr->code[2] = operand(c, i + 1);
+        instr->len = 3;
+        fusions[FUSE_GET_LOCAL2].count++;
+        return true;
+    }
+
+#undef FUSE
+
+    return false;
+}
+
+void peephole_optimize(Chunk *chunk)
+{
+    Code c = {
+        .chunk   = chunk,
+        .starts  = check_alloc(malloc(sizeof(size_t) * (chunk->size + 1))),
+        .count   = 0,
+        .targets = check_alloc(calloc(chunk->size + 1, sizeof(int))),
+        .dead    = NULL,
+    };
+    for (size_t offset = 0; offset < chunk->size; offset += chunk_instr_size(chunk, offset)) {
+        c.starts[c.count++] = offset;
+        long target = chunk_branch_target(chunk, offset);
+        if (target >= 0)
+            c.targets[target]++;
+    }
+    c.starts[c.count] = chunk->size;
+    c.dead = check_alloc(calloc(c.count + 1, sizeof(bool)));
+
+    Instr *out = check_alloc(malloc(sizeof(Instr) * (c.count + 1)));
+    size_t out_count = 0;
+    for (size_t i = 0; i < c.count; ) {
+        if (c.dead[i]) {
+            i++;
+            continue;
+        }
+        Instr *instr = &out[out_count++];
+        size_t len = 1;
+        instr->target = -1;
+        if (fuse(&c, i, instr, &len))
+            instr->copy = false;
+        else {
+            // a failed match may have left its length behind
+            len = 1;
+            instr->copy = true;
+            instr->target = chunk_branch_target(chunk, c.starts[i]);
+        }
+        instr->from = c.starts[i];
+        instr->size = c.starts[i + len] - c.starts[i];
+        if (instr->copy)
+            instr->len = instr->size;
+        i += len;
+    }
+
+    // lay out the new code, mapping old instruction offsets to new ones
+    size_t *map = check_alloc(malloc(sizeof(size_t) * (chunk->size + 1)));
+    size_t size = 0;
+    for (size_t i = 0; i < out_count; i++) {
+        map[out[i].from] = size;
+        size += out[i].len;
+    }
+    map[chunk->size] = size;
+
+    u8 *code   = check_alloc(malloc(size));
+    int *lines = check_alloc(malloc(sizeof(int) * size));
+    size_t pos = 0;
+    for (size_t i = 0; i < out_count; i++) {
+        Instr *instr = &out[i];
+        if (instr->copy) {
+            for (size_t k = 0; k < instr->len; k++) {
+                code[pos + k]  = chunk->code[instr->from + k];
+                lines[pos + k] = chunk->lines[instr->from + k];
+            }
+        } else {
+            for (size_t k = 0; k < instr->len; k++) {
+                code[pos + k]  = instr->code[k];
+                lines[pos + k] = chunk->lines[instr->from];
+            }
+        }
+        if (instr->target >= 0) {
+            size_t target = map[instr->target];
+            size_t jump = code[pos] == OP_BRANCH_BACK ? pos + 3 - target : target - pos - 3;
+            code[pos + 1] = (jump >> 8) & 0xFF;
+            code[pos + 2] =  jump       & 0xFF;
+        }
+        pos += instr->len;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        chunk->code[i]  = code[i];
+        chunk->lines[i] = lines[i];
+    }
+    chunk->size = size;
+
+    free(code);
+    free(lines);
+    free(map);
+    free(out);
+    free(c.dead);
+    free(c.targets);
+    free(c.starts);
+}
+
+void peephole_print_stats(void)
+{
+    fflush(stdout);
+    fprintf(stderr, "peephole fusions:\n");
+    for (int i = 0; i < FUSE_COUNT; i++)
+        fprintf(stderr, "    %-22s -> %-6s %zu\n", fusions[i].from, fusions[i].to, fusions[i].count);
+}
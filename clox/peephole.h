@@ -0,0 +1,9 @@
+#ifndef PEEPHOLE_H_INCLUDED
+#define PEEPHOLE_H_INCLUDED
+
+#include "chunk.h"
+
+void peephole_optimize(Chunk *chunk);
+void peephole_print_stats(void);
+
+#endif
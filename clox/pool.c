@@ -0,0 +1,132 @@
+#include "pool.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uint.h"
+
+/*
+ * segregated-fit allocator for everything that goes through reallocate().
+ * requests up to POOL_MAX_SIZE bytes are rounded up to a multiple of
+ * POOL_GRANULE and served from a free list for that size class; blocks
+ * are carved out of POOL_ARENA_SIZE arenas and never go back to malloc
+ * or to another class. bigger requests go straight to malloc.
+ * callers always pass the size they asked for when freeing or growing,
+ * which is enough to find the class again, so blocks carry no header.
+ */
+
+#define POOL_GRANULE    16
+#define POOL_MAX_SIZE   512
+#define POOL_CLASSES    (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_ARENA_SIZE (64 * 1024)
+
+// under AddressSanitizer every block gets its own malloc, so it can be checked
+#if defined(__SANITIZE_ADDRESS__)
+#define POOL_DISABLED
+#endif
+
+typedef struct Block {
+    struct Block *next;
+} Block;
+
+typedef struct Arena {
+    struct Arena *next;
+    // blocks follow, aligned like the header
+    _Alignas(POOL_GRANULE) u8 data[];
+} Arena;
+
+static Block *free_lists[POOL_CLASSES];
+static Arena *arenas = NULL;
+static u8 *arena_top = NULL;
+static u8 *arena_end = NULL;
+
+#ifndef POOL_DISABLED
+static bool is_pooled(size_t size) { return size > 0 && size <= POOL_MAX_SIZE; }
+static size_t size_class(size_t size) { return (size - 1) / POOL_GRANULE; }
+
+static void *alloc_block(size_t size)
+{
+    size_t class = size_class(size);
+    Block *block = free_lists[class];
+    if (block != NULL) {
+        free_lists[class] = block->next;
+        return block;
+    }
+
+    size_t block_size = (class + 1) * POOL_GRANULE;
+    if ((size_t)(arena_end - arena_top) < block_size) {
+        // what's left of the old arena is lost, at most POOL_MAX_SIZE bytes
+        Arena *arena = malloc(sizeof(Arena) + POOL_ARENA_SIZE);
+        if (!arena)
+            abort();
+        arena->next = arenas;
+        arenas      = arena;
+        arena_top   = arena->data;
+        arena_end   = arena->data + POOL_ARENA_SIZE;
+    }
+    void *res = arena_top;
+    arena_top += block_size;
+    return res;
+}
+
+static void free_block(void *ptr, size_t size)
+{
+    Block *block = ptr;
+    size_t class = size_class(size);
+    block->next = free_lists[class];
+    free_lists[class] = block;
+}
+#endif
+
+void *pool_realloc(void *ptr, size_t old, size_t new)
+{
+#ifdef POOL_DISABLED
+    if (new == 0) {
+        free(ptr);
+        return NULL;
+    }
+    void *res = realloc(ptr, new);
+    if (!res)
+        abort();
+    return res;
+#else
+    if (ptr == NULL)
+        old = 0;
+    if (!is_pooled(old) && !is_pooled(new)) {
+        if (new == 0) {
+            free(ptr);
+            return NULL;
+        }
+        void *res = realloc(ptr, new);
+        if (!res)
+            abort();
+        return res;
+    }
+    if (is_pooled(old) && is_pooled(new) && size_class(old) == size_class(new))
+        return ptr;
+
+    void *res = NULL;
+    if (is_pooled(new))
+        res = alloc_block(new);
+    else if (new > 0 && !(res = malloc(new)))
+        abort();
+    if (ptr != NULL && res != NULL)
+        memcpy(res, ptr, old < new ? old : new);
+    if (is_pooled(old))
+        free_block(ptr, old);
+    else
+        free(ptr);
+    return res;
+#endif
+}
+
+void pool_free_all(void)
+{
+    while (arenas != NULL) {
+        Arena *next = arenas->next;
+        free(arenas);
+        arenas = next;
+    }
+    arena_top = arena_end = NULL;
+    memset(free_lists, 0, sizeof(free_lists));
+}
@@ -0,0 +1,9 @@
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+#include <stddef.h>
+
+void *pool_realloc(void *ptr, size_t old, size_t new);
+void pool_free_all(void);
+
+#endif
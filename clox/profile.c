@@ -0,0 +1,167 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "uint.h"
+#include "vm.h"
+
+/*
+ * a site is a line of a function and the type of object allocated there.
+ * functions can move or die before the report, so sites keep a copy of
+ * the function's name rather than a pointer to it.
+ * sampling one allocation in rate, at random, and counting it rate times
+ * keeps the estimate unbiased even for loops whose allocations would line
+ * up with a fixed interval.
+ */
+
+#define PROFILE_NAME_MAX 48
+
+typedef struct {
+    char name[PROFILE_NAME_MAX];    // empty if the slot is free
+    int line;
+    ObjType type;
+    u64 bytes;
+    u64 count;
+} Site;
+
+long profile_countdown = LONG_MAX;
+
+static long rate = 0;       // 0 while the profiler is off
+static u64 random_state = 0x9e3779b97f4a7c15ull;
+static Site *sites = NULL;
+static size_t site_count = 0;
+static size_t site_cap = 0;
+
+// xorshift64*, which is plenty for picking sample intervals
+static u64 next_random()
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dull;
+}
+
+// between 1 and 2 * rate - 1, so rate on average
+static long next_interval()
+{
+    return rate == 1 ? 1 : 1 + next_random() % (2 * rate - 1);
+}
+
+void profile_init(long sample_rate)
+{
+    rate = sample_rate;
+    profile_countdown = next_interval();
+}
+
+static u32 hash_site(const char *name, int line, ObjType type)
+{
+    u32 hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++)
+        hash = (hash ^ (u8)*c) * 16777619;
+    hash = (hash ^ (u32)line) * 16777619;
+    return (hash ^ type) * 16777619;
+}
+
+static Site *find_site(const char *name, int line, ObjType type)
+{
+    if (site_count * 2 >= site_cap) {
+        Site *old = sites;
+        size_t old_cap = site_cap;
+        site_cap = site_cap == 0 ? 256 : site_cap * 2;
+        sites = calloc(site_cap, sizeof(Site));
+        if (!sites)
+            abort();
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name[0] == '\0')
+                continue;
+            size_t j = hash_site(old[i].name, old[i].line, old[i].type) & (site_cap - 1);
+            while (sites[j].name[0] != '\0')
+                j = (j + 1) & (site_cap - 1);
+            sites[j] = old[i];
+        }
+        free(old);
+    }
+    size_t i = hash_site(name, line, type) & (site_cap - 1);
+    for (; sites[i].name[0] != '\0'; i = (i + 1) & (site_cap - 1)) {
+        Site *site = &sites[i];
+        if (site->line == line && site->type == type && strcmp(site->name, name) == 0)
+            return site;
+    }
+    Site *site = &sites[i];
+    snprintf(site->name, sizeof(site->name), "%s", name);
+    site->line = line;
+    site->type = type;
+    site_count++;
+    return site;
+}
+
+void profile_sample(ObjType type, size_t size)
+{
+    profile_countdown = next_interval();
+    const char *name = "(compiler)";
+    int line = 0;
+    if (vm.frame_size > 0) {
+        CallFrame *frame = &vm.frames[vm.frame_size - 1];
+        ObjFunction *fun = frame->closure->fun;
+        name = fun->name != NULL ? fun->name->data : "(script)";
+        size_t offset = frame->ip - fun->chunk.code;
+        line = fun->chunk.lines[offset > 0 ? offset - 1 : 0];
+    }
+    Site *site = find_site(name, line, type);
+    site->bytes += (u64)size * rate;
+    site->count += rate;
+}
+
+static int by_bytes(const void *a, const void *b)
+{
+    const Site *x = a, *y = b;
+    if (x->bytes != y->bytes)
+        return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+void profile_print()
+{
+    if (rate == 0)
+        return;
+    fflush(stdout);
+    // move the sites to the front of the table, then sort them
+    size_t count = 0;
+    for (size_t i = 0; i < site_cap; i++)
+        if (sites[i].name[0] != '\0')
+            sites[count++] = sites[i];
+    qsort(sites, count, sizeof(Site), by_bytes);
+    site_cap = count;   // the table is no longer usable for lookups
+    site_count = count;
+
+    u64 total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += sites[i].bytes;
+    if (rate == 1)
+        fprintf(stderr, "allocations:\n");
+    else
+        fprintf(stderr, "allocations (about 1 in %ld sampled):\n", rate);
+    fprintf(stderr, "%14s %12s %7s  site\n", "bytes", "objects", "share");
+    for (size_t i = 0; i < count; i++) {
+        Site *site = &sites[i];
+        fprintf(stderr, "%14llu %12llu %6.2f%%  ",
+            (unsigned long long)site->bytes, (unsigned long long)site->count,
+            total > 0 ? site->bytes * 100.0 / total : 0.0);
+        if (site->line > 0)
+            fprintf(stderr, "%s:%d in %s", vm.filename, site->line, site->name);
+        else
+            fprintf(stderr, "%s", site->name);
+        fprintf(stderr, " (%s)\n", obj_type_name(site->type));
+    }
+}
+
+void profile_free()
+{
+    free(sites);
+    sites = NULL;
+    site_count = site_cap = 0;
+    rate = 0;
+    profile_countdown = LONG_MAX;
+}
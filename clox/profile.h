@@ -0,0 +1,26 @@
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include <stddef.h>
+#include "object.h"
+
+/*
+ * allocation-site profiler: every object allocation counts down, and the
+ * ones that reach zero are attributed to the function and line running
+ * at the time. with the profiler off the countdown starts so high it
+ * never gets there.
+ */
+extern long profile_countdown;
+
+void profile_init(long rate);
+void profile_sample(ObjType type, size_t size);
+void profile_print(void);
+void profile_free(void);
+
+static inline void profile_alloc(ObjType type, size_t size)
+{
+    if (--profile_countdown == 0)
+        profile_sample(type, size);
+}
+
+#endif
@@ -0,0 +1,408 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "uint.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+#include "list.h"
+
+/*
+ * a snapshot walks the objects reachable from the roots, following the
+ * same edges as mark_black(), and numbers them in the order it finds
+ * them. it doesn't allocate from the gc, so it can run in the middle of
+ * the program without collecting or moving anything. the walk and the
+ * file are built with malloc and thrown away at the end.
+ */
+
+#define TYPE_COUNT  (OBJ_SHAPE + 1)
+#define TYPE_ROOTS  TYPE_COUNT  // the type of node 0
+
+typedef struct {
+    // object -> index, open addressing
+    Obj **keys;
+    u32 *ids;
+    size_t map_cap;
+    // objects by index, node 0 has none
+    Obj **nodes;
+    size_t node_count;
+    size_t node_cap;
+    // the edges of node i are edges[starts[i]] up to edges[starts[i + 1]]
+    u32 *edges;
+    size_t edge_count;
+    size_t edge_cap;
+    size_t *starts;
+} Walk;
+
+static volatile sig_atomic_t requested = 0;
+static int signal_count = 0;
+
+static void *grow(void *ptr, size_t *cap, size_t size)
+{
+    *cap = *cap < 64 ? 64 : *cap * 2;
+    ptr = realloc(ptr, *cap * size);
+    if (!ptr)
+        abort();
+    return ptr;
+}
+
+static size_t hash_ptr(Obj *obj)
+{
+    u64 x = (u64)(uintptr_t)obj;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return x;
+}
+
+static void map_grow(Walk *walk)
+{
+    Obj **keys = walk->keys;
+    u32 *ids   = walk->ids;
+    size_t cap = walk->map_cap;
+    walk->map_cap = cap == 0 ? 1024 : cap * 2;
+    walk->keys = calloc(walk->map_cap, sizeof(Obj *));
+    walk->ids  = malloc(walk->map_cap * sizeof(u32));
+    if (!walk->keys || !walk->ids)
+        abort();
+    for (size_t i = 0; i < cap; i++) {
+        if (keys[i] == NULL)
+            continue;
+        size_t j = hash_ptr(keys[i]) & (walk->map_cap - 1);
+        while (walk->keys[j] != NULL)
+            j = (j + 1) & (walk->map_cap - 1);
+        walk->keys[j] = keys[i];
+        walk->ids[j]  = ids[i];
+    }
+    free(keys);
+    free(ids);
+}
+
+// the index of an object, given to it (and queued) on first sight
+static u32 node_of(Walk *walk, Obj *obj)
+{
+    if (walk->node_count * 2 >= walk->map_cap)
+        map_grow(walk);
+    size_t i = hash_ptr(obj) & (walk->map_cap - 1);
+    while (walk->keys[i] != NULL) {
+        if (walk->keys[i] == obj)
+            return walk->ids[i];
+        i = (i + 1) & (walk->map_cap - 1);
+    }
+    if (walk->node_count == walk->node_cap)
+        walk->nodes = grow(walk->nodes, &walk->node_cap, sizeof(Obj *));
+    u32 id = walk->node_count++;
+    walk->nodes[id] = obj;
+    walk->keys[i] = obj;
+    walk->ids[i]  = id;
+    return id;
+}
+
+static void edge_to(Walk *walk, Obj *obj)
+{
+    if (obj == NULL)
+        return;
+    u32 id = node_of(walk, obj);
+    if (walk->edge_count == walk->edge_cap)
+        walk->edges = grow(walk->edges, &walk->edge_cap, sizeof(u32));
+    walk->edges[walk->edge_count++] = id;
+}
+
+static void edge_to_value(Walk *walk, Value value)
+{
+    if (IS_OBJ(value))
+        edge_to(walk, AS_OBJ(value));
+}
+
+static void edges_to_arr(Walk *walk, ValueArray *arr)
+{
+    for (size_t i = 0; i < arr->size; i++)
+        edge_to_value(walk, arr->values[i]);
+}
+
+static void edges_to_table(Walk *walk, Table *tab)
+{
+    for (size_t i = 0; i < tab->cap; i++) {
+        Entry *entry = &tab->entries[i];
+        if (entry->key == NULL)
+            continue;
+        edge_to(walk, (Obj *)entry->key);
+        edge_to_value(walk, entry->value);
+    }
+}
+
+// same roots as mark_roots(), but the compiler's: it isn't running
+static void root_edges(Walk *walk)
+{
+    for (Value *slot = vm.stack; slot < vm.sp; slot++)
+        edge_to_value(walk, *slot);
+    for (size_t i = 0; i < vm.frame_size; i++)
+        edge_to(walk, (Obj *)vm.frames[i].closure);
+    LIST_FOR_EACH(ObjUpvalue, vm.open_upvalues, upvalue)
+        edge_to(walk, (Obj *)upvalue);
+    edges_to_table(walk, &vm.global_slots);
+    edges_to_arr(walk, &vm.global_names);
+    edges_to_arr(walk, &vm.global_values);
+    edge_to(walk, (Obj *)vm.init_string);
+    edges_to_arr(walk, &vm.selectors);
+    edge_to(walk, (Obj *)vm.empty_shape);
+    edge_to(walk, (Obj *)vm.gc_stats_class);
+}
+
+// same edges as mark_black()
+static void object_edges(Walk *walk, Obj *obj)
+{
+    switch (obj->type) {
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    case OBJ_ROPE: {
+        ObjRope *rope = (ObjRope *)obj;
+        edge_to(walk, (Obj *)rope->flat);
+        edge_to(walk, rope->left);
+        edge_to(walk, rope->right);
+        break;
+    }
+    case OBJ_UPVALUE:
+        edge_to_value(walk, ((ObjUpvalue *)obj)->closed);
+        break;
+    case OBJ_FUNCTION: {
+        ObjFunction *fun = (ObjFunction *)obj;
+        edge_to(walk, (Obj *)fun->name);
+        edges_to_arr(walk, &fun->chunk.constants);
+        for (size_t i = 0; i < fun->chunk.cache_size; i++) {
+            InlineCache *cache = &fun->chunk.caches[i];
+            for (int j = 0; j < cache->size; j++) {
+                CacheEntry *entry = &cache->entries[j];
+                edge_to(walk, (Obj *)entry->klass);
+                edge_to(walk, (Obj *)entry->shape);
+                edge_to(walk, (Obj *)entry->next_shape);
+                edge_to_value(walk, entry->method);
+            }
+        }
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure *closure = (ObjClosure *)obj;
+        edge_to(walk, (Obj *)closure->fun);
+        for (int i = 0; i < closure->upvalue_count; i++)
+            edge_to(walk, (Obj *)closure->upvalues[i]);
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass *klass = (ObjClass *)obj;
+        edge_to(walk, (Obj *)klass->name);
+        edge_to(walk, (Obj *)klass->init);
+        for (int i = 0; i < klass->method_cap; i++)
+            edge_to(walk, (Obj *)klass->methods[i]);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance *inst = (ObjInstance *)obj;
+        edge_to(walk, (Obj *)inst->klass);
+        edge_to(walk, (Obj *)inst->shape);
+        for (int i = 0; i < inst->shape->slot_count; i++)
+            edge_to_value(walk, *instance_field(inst, i));
+        break;
+    }
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        edge_to_value(walk, bound->receiver);
+        edge_to(walk, (Obj *)bound->method);
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape *shape = (ObjShape *)obj;
+        edge_to(walk, (Obj *)shape->parent);
+        edge_to(walk, (Obj *)shape->name);
+        edges_to_table(walk, &shape->transitions);
+        break;
+    }
+    }
+}
+
+static void walk_heap(Walk *walk)
+{
+    memset(walk, 0, sizeof(*walk));
+    walk->nodes = grow(walk->nodes, &walk->node_cap, sizeof(Obj *));
+    walk->nodes[walk->node_count++] = NULL;
+    size_t starts_cap = 0;
+    for (size_t i = 0; i < walk->node_count; i++) {
+        if (i == starts_cap)
+            walk->starts = grow(walk->starts, &starts_cap, sizeof(size_t));
+        walk->starts[i] = walk->edge_count;
+        if (i == 0)
+            root_edges(walk);
+        else
+            object_edges(walk, walk->nodes[i]);
+    }
+    if (walk->node_count == starts_cap)
+        walk->starts = grow(walk->starts, &starts_cap, sizeof(size_t));
+    walk->starts[walk->node_count] = walk->edge_count;
+}
+
+// the object and the memory it owns outside of it
+static size_t shallow_size(Obj *obj)
+{
+    size_t size = obj_size(obj);
+    switch (obj->type) {
+    case OBJ_FUNCTION: {
+        Chunk *chunk = &((ObjFunction *)obj)->chunk;
+        size += chunk->cap * (sizeof(u8) + sizeof(int))
+              + chunk->constants.cap * sizeof(Value)
+              + chunk->cache_cap * sizeof(InlineCache);
+        break;
+    }
+    case OBJ_CLOSURE:
+        size += ((ObjClosure *)obj)->upvalue_count * sizeof(ObjUpvalue *);
+        break;
+    case OBJ_CLASS:
+        size += ((ObjClass *)obj)->method_cap * sizeof(ObjClosure *);
+        break;
+    case OBJ_INSTANCE:
+        size += ((ObjInstance *)obj)->extra_cap * sizeof(Value);
+        break;
+    case OBJ_SHAPE:
+        size += table_memory(&((ObjShape *)obj)->transitions);
+        break;
+    case OBJ_STRING:
+    case OBJ_ROPE:
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+    case OBJ_BOUND_METHOD:
+        break;
+    }
+    return size;
+}
+
+static ObjString *name_of(Obj *obj)
+{
+    switch (obj->type) {
+    case OBJ_STRING:    return (ObjString *)obj;
+    case OBJ_ROPE:      return ((ObjRope *)obj)->flat;
+    case OBJ_FUNCTION:  return ((ObjFunction *)obj)->name;
+    case OBJ_CLOSURE:   return ((ObjClosure *)obj)->fun->name;
+    case OBJ_CLASS:     return ((ObjClass *)obj)->name;
+    case OBJ_INSTANCE:  return ((ObjInstance *)obj)->klass->name;
+    case OBJ_BOUND_METHOD: return ((ObjBoundMethod *)obj)->method->fun->name;
+    case OBJ_SHAPE:     return ((ObjShape *)obj)->name;
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+        break;
+    }
+    return NULL;
+}
+
+static void write_u8(FILE *file, u8 x)
+{
+    fputc(x, file);
+}
+
+static void write_u16(FILE *file, u16 x)
+{
+    write_u8(file, x & 0xFF);
+    write_u8(file, x >> 8);
+}
+
+static void write_u32(FILE *file, u32 x)
+{
+    write_u16(file, x & 0xFFFF);
+    write_u16(file, x >> 16);
+}
+
+static void write_str(FILE *file, const char *str, size_t len)
+{
+    if (len > SNAPSHOT_MAX_NAME)
+        len = SNAPSHOT_MAX_NAME;
+    write_u16(file, len);
+    fwrite(str, 1, len, file);
+}
+
+static void write_snapshot(FILE *file, Walk *walk)
+{
+    fwrite(SNAPSHOT_MAGIC, 1, strlen(SNAPSHOT_MAGIC), file);
+    write_u32(file, SNAPSHOT_VERSION);
+
+    write_u32(file, TYPE_COUNT + 1);
+    for (int i = 0; i < TYPE_COUNT; i++)
+        write_str(file, obj_type_name(i), strlen(obj_type_name(i)));
+    write_str(file, "roots", 5);
+
+    write_u32(file, walk->node_count);
+    write_u8(file, TYPE_ROOTS);
+    write_u32(file, 0);
+    write_str(file, "", 0);
+    for (size_t i = 1; i < walk->node_count; i++) {
+        Obj *obj = walk->nodes[i];
+        write_u8(file, obj->type);
+        write_u32(file, shallow_size(obj));
+        if (obj->type == OBJ_NATIVE) {
+            const char *name = ((ObjNative *)obj)->name;
+            write_str(file, name, strlen(name));
+        } else {
+            ObjString *name = name_of(obj);
+            if (name != NULL)
+                write_str(file, name->data, name->len);
+            else
+                write_str(file, "", 0);
+        }
+    }
+
+    write_u32(file, walk->edge_count);
+    for (size_t i = 0; i < walk->node_count; i++) {
+        write_u32(file, walk->starts[i + 1] - walk->starts[i]);
+        for (size_t j = walk->starts[i]; j < walk->starts[i + 1]; j++)
+            write_u32(file, walk->edges[j]);
+    }
+}
+
+bool heap_snapshot(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    Walk walk;
+    walk_heap(&walk);
+    write_snapshot(file, &walk);
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    free(walk.keys);
+    free(walk.ids);
+    free(walk.nodes);
+    free(walk.edges);
+    free(walk.starts);
+    return ok;
+}
+
+/* objects can be anywhere in the middle of being built when the signal
+ * arrives, so it only asks for a snapshot at the next safepoint, which
+ * the interpreter loop checks for along with pending collections. */
+static void on_signal(int sig)
+{
+    requested = 1;
+    vm.gc_pending = true;
+}
+
+void snapshot_init()
+{
+    signal(SIGUSR2, on_signal);
+}
+
+void snapshot_if_requested()
+{
+    if (!requested)
+        return;
+    requested = 0;
+    char path[64];
+    snprintf(path, sizeof(path), "clox-%ld-%d.heapsnapshot", (long)getpid(), ++signal_count);
+    if (heap_snapshot(path))
+        fprintf(stderr, "heap snapshot written to %s\n", path);
+    else
+        perror("error: couldn't write heap snapshot");
+}
@@ -0,0 +1,29 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <stdbool.h>
+
+/*
+ * heap snapshot file format, read back by tools/heapsnap.c.
+ * integers are little endian, strings are a u16 length and their bytes.
+ *
+ *     "CLOXHEAP" u32 version
+ *     u32 type count, then a string for each type
+ *     u32 node count, then for each node:
+ *         u8 type, u32 shallow size, string name
+ *     u32 edge count, then for each node:
+ *         u32 number of edges, then a u32 node index for each of them
+ *
+ * node 0 stands for the roots of the vm, the others are the objects they
+ * reach. names are class names for classes and instances, function names
+ * for functions and closures, and the start of the text of strings.
+ */
+#define SNAPSHOT_MAGIC      "CLOXHEAP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_MAX_NAME   64
+
+bool heap_snapshot(const char *path);
+void snapshot_init(void);
+void snapshot_if_requested(void);
+
+#endif
@@ -1,129 +1,228 @@
 #include "table.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "memory.h"
 #include "vector.h"
 #include "object.h"
 
-#define TABLE_MAX_LOAD 0.75
+// a control byte is one of these, or the 7 bits of a key's hash
+#define CTRL_EMPTY      0x80
+#define CTRL_DELETED    0xFE
 
-static bool is_empty(Entry *entry)
+// deleted slots count too: a probe only stops at an empty one
+#define TABLE_MAX_LOAD(cap) ((cap) - (cap) / 8)
+
+static u8 *control_bytes(Entry *entries, size_t cap)
 {
-    return IS_NIL(entry->value);
+    return (u8 *)(entries + cap);
 }
 
-static Value empty_value()
+static bool is_small(size_t cap)
 {
-    return VALUE_MKNIL();
+    return cap <= TABLE_SMALL;
 }
 
-static ObjString *empty_key()
+static size_t table_bytes(size_t cap)
 {
-    return NULL;
+    return is_small(cap) ? cap * sizeof(Entry) : cap * (sizeof(Entry) + 1);
+}
+
+// the low bits of the hash pick the first group, the high ones are kept
+static u8 hash_tag(u32 hash)
+{
+    return hash >> 25;
+}
+
+// bit i is set if the control byte of slot i of the group is byte
+static u32 match_byte(const u8 *group, u8 byte)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+    u32 bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
+        bits |= (u32)(group[i] == byte) << i;
+    return bits;
+#endif
 }
 
-static Value make_tombstone()
+// empty and deleted slots are the ones with the high bit set
+static u32 match_free(const u8 *group)
 {
-    return VALUE_MKBOOL(true);
+#ifdef __SSE2__
+    return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    u32 bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
+        bits |= (u32)(group[i] >> 7) << i;
+    return bits;
+#endif
 }
 
-static bool objstr_cmp(ObjString *a, ObjString *b)
+static int first_bit(u32 bits)
 {
-    return a == b; // we have string interning
+    return __builtin_ctz(bits);
 }
 
-static bool objstring_is_null(ObjString *str) { return str == NULL; }
+/* groups are probed in triangular steps (1, 2, 3, ... groups further each
+ * time), which visits all of them when their number is a power of two. */
+#define FOR_EACH_GROUP(g, hash, cap) \
+    for (size_t g = (hash) & ((cap) / TABLE_GROUP - 1), step_ = 1; ; \
+         g = (g + step_++) & ((cap) / TABLE_GROUP - 1))
 
-static u32 objstr_hash(ObjString *str) { return str->hash; }
+static Entry *scan_small(Table *tab, ObjString *key)
+{
+    for (size_t i = 0; i < tab->size; i++)
+        if (tab->entries[i].key == key)
+            return &tab->entries[i];
+    return NULL;
+}
 
-static Entry *find_entry(Entry *entries, size_t cap, ObjString *key)
+/* the keys of a small table are compared two at a time, without a branch
+ * to mispredict for each. sse2 has no 64-bit compare, so both halves of a
+ * pointer have to match. the unused entries at the end have a NULL key,
+ * which matches nothing. */
+static Entry *find_small(Table *tab, ObjString *key)
 {
-    u32 i = objstr_hash(key) % cap;
-    Entry *first_tombstone = NULL;
-    for (;;) {
-        Entry *ptr = &entries[i];
-        // our tombstone representation is key = NULL and value = true_obj
-        // our empty entry representation is key = NULL and value = nil_obj
-        if (objstring_is_null(ptr->key)) {
-            if (is_empty(ptr))
-                return first_tombstone != NULL ? first_tombstone : ptr;
-            else if (first_tombstone == NULL)
-                first_tombstone = ptr;
-        } else if (objstr_cmp(ptr->key, key))
-            return ptr;
-        i = (i + 1) & (cap - 1);
+#if defined(__SSE2__) && UINTPTR_MAX == UINT64_MAX
+    __m128i k = _mm_set1_epi64x((long long)(uintptr_t)key);
+    u32 bits = 0;
+    for (size_t i = 0; i < tab->cap; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&tab->entries[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&tab->entries[i + 1]);
+        __m128i eq = _mm_cmpeq_epi32(_mm_unpacklo_epi64(a, b), k);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        bits |= (u32)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
     }
+    return bits != 0 ? &tab->entries[first_bit(bits)] : NULL;
+#else
+    return scan_small(tab, key);
+#endif
 }
 
-static void adjust_cap(Table *tab, size_t cap)
+static Entry *find_entry(Entry *entries, size_t cap, ObjString *key)
 {
-    Entry *entries = ALLOCATE(Entry, cap);
-    for (size_t i = 0; i < cap; i++) {
-        entries[i].key   = empty_key();
-        entries[i].value = empty_value();
+    u8 *ctrl = control_bytes(entries, cap);
+    u8 tag = hash_tag(key->hash);
+    FOR_EACH_GROUP(g, key->hash, cap) {
+        u8 *group = &ctrl[g * TABLE_GROUP];
+        for (u32 bits = match_byte(group, tag); bits != 0; bits &= bits - 1) {
+            Entry *entry = &entries[g * TABLE_GROUP + first_bit(bits)];
+            if (entry->key == key) // we have string interning
+                return entry;
+        }
+        if (match_byte(group, CTRL_EMPTY) != 0)
+            return NULL;
     }
+}
 
-    tab->size = 0;
-    for (size_t i = 0; i < tab->cap; i++) {
-        Entry *entry = &tab->entries[i];
-        if (objstring_is_null(entry->key))
+// puts a key that isn't in the table after the others, or in the first
+// free slot of its probe
+static void insert_entry(Table *tab, ObjString *key, Value value)
+{
+    if (is_small(tab->cap)) {
+        tab->entries[tab->size].key   = key;
+        tab->entries[tab->size].value = value;
+        tab->size++;
+        return;
+    }
+    u8 *ctrl = control_bytes(tab->entries, tab->cap);
+    FOR_EACH_GROUP(g, key->hash, tab->cap) {
+        u32 bits = match_free(&ctrl[g * TABLE_GROUP]);
+        if (bits == 0)
             continue;
-        Entry *dest = find_entry(entries, cap, entry->key);
-        dest->key   = entry->key;
-        dest->value = entry->value;
+        size_t i = g * TABLE_GROUP + first_bit(bits);
+        if (ctrl[i] == CTRL_DELETED)
+            tab->tombstones--;
+        ctrl[i] = hash_tag(key->hash);
+        tab->entries[i].key   = key;
+        tab->entries[i].value = value;
         tab->size++;
+        return;
     }
-    FREE_ARRAY(Entry, tab->entries, tab->cap);
+}
 
-    tab->entries = entries;
-    tab->cap     = cap;
+static void adjust_cap(Table *tab, size_t cap)
+{
+    Entry *entries = (Entry *)ALLOCATE(u8, table_bytes(cap));
+    for (size_t i = 0; i < cap; i++) {
+        entries[i].key   = NULL;
+        entries[i].value = VALUE_MKNIL();
+    }
+    if (!is_small(cap))
+        memset(control_bytes(entries, cap), CTRL_EMPTY, cap);
+
+    Entry *old = tab->entries;
+    size_t old_cap = tab->cap;
+    tab->entries    = entries;
+    tab->cap        = cap;
+    tab->size       = 0;
+    tab->tombstones = 0;
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].key != NULL)
+            insert_entry(tab, old[i].key, old[i].value);
+    FREE_ARRAY(u8, old, table_bytes(old_cap));
 }
 
 void table_init(Table *tab)
 {
-    tab->size    = 0;
-    tab->cap     = 0;
-    tab->entries = NULL;
+    tab->size       = 0;
+    tab->cap        = 0;
+    tab->tombstones = 0;
+    tab->entries    = NULL;
 }
 
 void table_free(Table *tab)
 {
-    FREE_ARRAY(Entry, tab->entries, tab->cap);
+    FREE_ARRAY(u8, tab->entries, table_bytes(tab->cap));
     table_init(tab);
 }
 
+static Entry *find(Table *tab, ObjString *key)
+{
+    if (is_small(tab->cap))
+        return find_small(tab, key);
+    return find_entry(tab->entries, tab->cap, key);
+}
+
 bool table_install(Table *tab, ObjString *key, Value value)
 {
-    if (tab->size + 1 > tab->cap * TABLE_MAX_LOAD) {
-        size_t cap = vector_grow_cap(tab->cap);
+    Entry *entry = find(tab, key);
+    if (entry != NULL) {
+        entry->value = value;
+        return false;
+    }
+    if (is_small(tab->cap)) {
+        if (tab->size == tab->cap)
+            adjust_cap(tab, tab->cap == 0 ? 4 : tab->cap == TABLE_SMALL ? TABLE_GROUP : tab->cap * 2);
+    } else if (tab->size + tab->tombstones + 1 > TABLE_MAX_LOAD(tab->cap)) {
+        // if it's mostly tombstones, getting rid of them is enough
+        size_t cap = tab->size + 1 > TABLE_MAX_LOAD(tab->cap) / 2 ? tab->cap * 2 : tab->cap;
         adjust_cap(tab, cap);
     }
-
-    Entry *entry = find_entry(tab->entries, tab->cap, key);
-    bool is_new = objstring_is_null(entry->key);
-    if (is_new && is_empty(entry))
-        tab->size++;
-    entry->key   = key;
-    entry->value = value;
-    return is_new;
+    insert_entry(tab, key, value);
+    return true;
 }
 
 void table_add_all(Table *from, Table *to)
 {
     for (size_t i = 0; i < from->cap; i++) {
         Entry *entry = &from->entries[i];
-        if (objstring_is_null(entry->key))
+        if (entry->key != NULL)
             table_install(to, entry->key, entry->value);
     }
 }
 
 bool table_lookup(Table *tab, ObjString *key, Value *value)
 {
-    if (tab->size == 0)
-        return false;
-    Entry *entry = find_entry(tab->entries, tab->cap, key);
-    if (objstring_is_null(entry->key))
+    Entry *entry = find(tab, key);
+    if (entry == NULL)
         return false;
     *value = entry->value;
     return true;
@@ -131,14 +230,37 @@ bool table_lookup(Table *tab, ObjString *key, Value *value)
 
 bool table_delete(Table *tab, ObjString *key)
 {
+    if (is_small(tab->cap)) {
+        // the wide loads of find_small() would wait on the stores of the
+        // delete before, so this one looks at a key at a time
+        Entry *entry = scan_small(tab, key);
+        if (entry == NULL)
+            return false;
+        // the last key fills the hole
+        Entry *last = &tab->entries[--tab->size];
+        *entry = *last;
+        last->key   = NULL;
+        last->value = VALUE_MKNIL();
+        return true;
+    }
     if (tab->size == 0)
         return false;
     Entry *entry = find_entry(tab->entries, tab->cap, key);
-    if (objstring_is_null(entry->key))
+    if (entry == NULL)
         return false;
-    // place a tombstone
+    size_t i = entry - tab->entries;
+    u8 *ctrl = control_bytes(tab->entries, tab->cap);
+    // no probe goes past a group with an empty slot, so the slot can be
+    // made empty again if its group already has one
+    if (match_byte(&ctrl[i / TABLE_GROUP * TABLE_GROUP], CTRL_EMPTY) != 0) {
+        ctrl[i] = CTRL_EMPTY;
+    } else {
+        ctrl[i] = CTRL_DELETED;
+        tab->tombstones++;
+    }
     entry->key   = NULL;
-    entry->value = make_tombstone();
+    entry->value = VALUE_MKNIL();
+    tab->size--;
     return true;
 }
 
@@ -147,20 +269,30 @@ bool table_delete(Table *tab, ObjString *key)
 ObjString *table_find_string(Table *tab, const char *data, size_t len,
                              u32 hash)
 {
-    if (tab->size == 0)
+    if (is_small(tab->cap)) {
+        for (size_t i = 0; i < tab->size; i++) {
+            ObjString *key = tab->entries[i].key;
+            if (key->len == len && key->hash == hash && memcmp(key->data, data, len) == 0)
+                return key;
+        }
         return NULL;
-    u32 i = hash & (tab->cap - 1);
-    for (;;) {
-        Entry *entry = &tab->entries[i];
-        if (objstring_is_null(entry->key)) {
-            if (is_empty(entry))
-                return NULL;
-        } else if (entry->key->len == len
-                && entry->key->hash == hash
-                && memcmp(entry->key->data, data, len) == 0) {
-            return entry->key;
+    }
+    u8 *ctrl = control_bytes(tab->entries, tab->cap);
+    u8 tag = hash_tag(hash);
+    FOR_EACH_GROUP(g, hash, tab->cap) {
+        u8 *group = &ctrl[g * TABLE_GROUP];
+        for (u32 bits = match_byte(group, tag); bits != 0; bits &= bits - 1) {
+            ObjString *key = tab->entries[g * TABLE_GROUP + first_bit(bits)].key;
+            if (key->len == len && key->hash == hash && memcmp(key->data, data, len) == 0)
+                return key;
         }
-        i = (i + 1) & (tab->cap - 1);
+        if (match_byte(group, CTRL_EMPTY) != 0)
+            return NULL;
     }
 }
 
+// what the table takes besides the Table itself
+size_t table_memory(Table *tab)
+{
+    return table_bytes(tab->cap);
+}
@@ -10,10 +10,28 @@ typedef struct {
     Value value;
 } Entry;
 
+/*
+ * most tables, like the transitions of a shape, only ever hold a few
+ * keys. up to TABLE_SMALL of them are kept at the front of a plain array
+ * and found by comparing addresses one after the other.
+ *
+ * bigger tables use open addressing in the style of abseil's swiss tables.
+ * every slot has a control byte, kept apart from the entries, holding 7
+ * bits of the key's hash or marking the slot empty or deleted. lookups
+ * compare the control bytes of a group of slots at once and only look at
+ * the entries whose bits match.
+ *
+ * either way, unused entries have a NULL key and a nil value, so code that
+ * walks the entries can skip them by the key alone.
+ */
+#define TABLE_SMALL 8
+#define TABLE_GROUP 16
+
 typedef struct Table {
-    size_t size;
-    size_t cap;
-    Entry *entries;
+    size_t size;        // keys in the table
+    size_t cap;         // up to TABLE_SMALL, or a power of two from TABLE_GROUP
+    size_t tombstones;  // deleted slots, which still make probes longer
+    Entry *entries;     // cap entries, then cap control bytes if it's hashed
 } Table;
 
 void table_init(Table *tab);
@@ -24,7 +42,10 @@ bool table_lookup(Table *tab, ObjString *key, Value *value);
 bool table_delete(Table *tab, ObjString *key);
 ObjString *table_find_string(Table *tab, const char *data, size_t len,
                              u32 hash);
+size_t table_memory(Table *tab);
 
+/* a delete from a small table moves the last key into the hole, so a
+ * loop that deletes while walking forward skips that key. */
 #define TABLE_FOR_EACH(tab, entry) \
     for (Entry *entry = tab->entries; ((size_t) (entry - tab->entries)) < tab->cap; entry++)
 
@@ -0,0 +1,375 @@
+/*
+ * heapsnap: reads a heap snapshot written by clox (see snapshot.h) and
+ * prints which objects keep the most memory alive.
+ *
+ *     heapsnap file [count]
+ *
+ * an object's retained size is what would be freed if it went away: its
+ * own size plus the retained sizes of the objects it dominates, the ones
+ * every path from the roots to them goes through. the dominator tree is
+ * computed with the algorithm of lengauer and tarjan.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "uint.h"
+#include "snapshot.h"
+
+typedef struct {
+    u8 type;
+    u32 size;
+    char name[SNAPSHOT_MAX_NAME + 1];
+} Node;
+
+typedef struct {
+    char **types;
+    u32 type_count;
+    Node *nodes;
+    u32 node_count;
+    u32 *edges;         // the edges of node i are edges[starts[i]] up to edges[starts[i + 1]]
+    u32 *starts;
+    u32 edge_count;
+} Snapshot;
+
+static FILE *file;
+static const char *path;
+
+static void fail(const char *msg)
+{
+    fprintf(stderr, "heapsnap: %s: %s\n", path, msg);
+    exit(1);
+}
+
+static void *alloc(size_t count, size_t size)
+{
+    void *ptr = calloc(count > 0 ? count : 1, size);
+    if (!ptr)
+        fail("out of memory");
+    return ptr;
+}
+
+static u8 read_u8()
+{
+    int c = fgetc(file);
+    if (c == EOF)
+        fail("truncated snapshot");
+    return c;
+}
+
+static u16 read_u16()
+{
+    u16 lo = read_u8();
+    return lo | read_u8() << 8;
+}
+
+static u32 read_u32()
+{
+    u32 lo = read_u16();
+    return lo | (u32)read_u16() << 16;
+}
+
+static void read_str(char *buf, size_t cap)
+{
+    size_t len = read_u16();
+    if (len >= cap)
+        fail("name too long");
+    if (fread(buf, 1, len, file) != len)
+        fail("truncated snapshot");
+    buf[len] = '\0';
+}
+
+static void read_snapshot(Snapshot *snap)
+{
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+     || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0)
+        fail("not a heap snapshot");
+    if (read_u32() != SNAPSHOT_VERSION)
+        fail("unsupported snapshot version");
+
+    snap->type_count = read_u32();
+    snap->types = alloc(snap->type_count, sizeof(char *));
+    for (u32 i = 0; i < snap->type_count; i++) {
+        snap->types[i] = alloc(SNAPSHOT_MAX_NAME + 1, 1);
+        read_str(snap->types[i], SNAPSHOT_MAX_NAME + 1);
+    }
+
+    snap->node_count = read_u32();
+    if (snap->node_count == 0)
+        fail("no roots");
+    snap->nodes = alloc(snap->node_count, sizeof(Node));
+    for (u32 i = 0; i < snap->node_count; i++) {
+        Node *node = &snap->nodes[i];
+        node->type = read_u8();
+        node->size = read_u32();
+        read_str(node->name, sizeof(node->name));
+        if (node->type >= snap->type_count)
+            fail("bad object type");
+    }
+
+    snap->edge_count = read_u32();
+    snap->edges  = alloc(snap->edge_count, sizeof(u32));
+    snap->starts = alloc(snap->node_count + 1, sizeof(u32));
+    u32 edge = 0;
+    for (u32 i = 0; i < snap->node_count; i++) {
+        snap->starts[i] = edge;
+        u32 count = read_u32();
+        if (count > snap->edge_count - edge)
+            fail("too many edges");
+        for (u32 j = 0; j < count; j++) {
+            u32 to = read_u32();
+            if (to >= snap->node_count)
+                fail("edge to a missing object");
+            snap->edges[edge++] = to;
+        }
+    }
+    snap->starts[snap->node_count] = edge;
+}
+
+#define UNDEF ((u32)-1)
+
+/*
+ * lengauer and tarjan's algorithm, in its simple version with path
+ * compression. everything but the graph is indexed by depth-first
+ * number, and nothing recurses: a long list of objects makes for a very
+ * deep search.
+ */
+typedef struct {
+    u32 *vertex;    // node of each number
+    u32 *parent;    // in the depth-first spanning tree
+    u32 *semi;
+    u32 *label;
+    u32 *ancestor;
+    u32 *dom;
+    u32 *stack;
+} Dom;
+
+// numbers the nodes reachable from node 0 in preorder, returns how many
+static u32 number_nodes(Snapshot *snap, Dom *d, u32 *number)
+{
+    u32 n = snap->node_count;
+    u32 *next = alloc(n, sizeof(u32));     // next edge to follow
+    u32 size = 0, count = 0;
+    for (u32 v = 0; v < n; v++)
+        number[v] = UNDEF;
+    number[0] = count;
+    d->vertex[count] = 0;
+    d->parent[count++] = UNDEF;
+    d->stack[size++] = 0;
+    next[0] = snap->starts[0];
+    while (size > 0) {
+        u32 v = d->stack[size - 1];
+        if (next[v] == snap->starts[v + 1]) {
+            size--;
+            continue;
+        }
+        u32 w = snap->edges[next[v]++];
+        if (number[w] != UNDEF)
+            continue;
+        number[w] = count;
+        d->vertex[count] = w;
+        d->parent[count++] = number[v];
+        d->stack[size++] = w;
+        next[w] = snap->starts[w];
+    }
+    free(next);
+    return count;
+}
+
+static u32 eval(Dom *d, u32 v)
+{
+    if (d->ancestor[v] == UNDEF)
+        return v;
+    // compress the path up to the last node with an ancestor
+    u32 size = 0;
+    for (u32 u = v; d->ancestor[d->ancestor[u]] != UNDEF; u = d->ancestor[u])
+        d->stack[size++] = u;
+    while (size > 0) {
+        u32 u = d->stack[--size];
+        u32 a = d->ancestor[u];
+        if (d->semi[d->label[a]] < d->semi[d->label[u]])
+            d->label[u] = d->label[a];
+        d->ancestor[u] = d->ancestor[a];
+    }
+    return d->label[v];
+}
+
+// each node's retained size, the sum of what it dominates
+static void retained_sizes(Snapshot *snap, u64 *retained)
+{
+    u32 n = snap->node_count;
+    Dom d;
+    u32 **arrays[] = { &d.vertex, &d.parent, &d.semi, &d.label, &d.ancestor, &d.dom, &d.stack };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++)
+        *arrays[i] = alloc(n, sizeof(u32));
+    u32 *number = alloc(n, sizeof(u32));
+    u32 reached = number_nodes(snap, &d, number);
+
+    // predecessors, in the same layout as the edges
+    u32 *pred_starts = alloc(n + 1, sizeof(u32));
+    u32 *preds = alloc(snap->edge_count, sizeof(u32));
+    for (u32 e = 0; e < snap->edge_count; e++)
+        pred_starts[snap->edges[e] + 1]++;
+    for (u32 i = 0; i < n; i++)
+        pred_starts[i + 1] += pred_starts[i];
+    u32 *fill = alloc(n, sizeof(u32));
+    for (u32 v = 0; v < n; v++)
+        for (u32 e = snap->starts[v]; e < snap->starts[v + 1]; e++) {
+            u32 w = snap->edges[e];
+            preds[pred_starts[w] + fill[w]++] = v;
+        }
+    free(fill);
+
+    // buckets of nodes by semidominator, as linked lists
+    u32 *bucket = alloc(reached, sizeof(u32));
+    u32 *bucket_next = alloc(reached, sizeof(u32));
+    for (u32 i = 0; i < reached; i++) {
+        d.semi[i] = d.label[i] = i;
+        d.ancestor[i] = bucket[i] = UNDEF;
+    }
+    for (u32 w = reached; w-- > 1; ) {
+        u32 node = d.vertex[w];
+        for (u32 e = pred_starts[node]; e < pred_starts[node + 1]; e++) {
+            u32 v = number[preds[e]];
+            if (v == UNDEF)
+                continue;
+            u32 u = eval(&d, v);
+            if (d.semi[u] < d.semi[w])
+                d.semi[w] = d.semi[u];
+        }
+        bucket_next[w] = bucket[d.semi[w]];
+        bucket[d.semi[w]] = w;
+        u32 p = d.parent[w];
+        d.ancestor[w] = p;
+        for (u32 v = bucket[p]; v != UNDEF; v = bucket_next[v]) {
+            u32 u = eval(&d, v);
+            d.dom[v] = d.semi[u] < d.semi[v] ? u : p;
+        }
+        bucket[p] = UNDEF;
+    }
+    for (u32 w = 1; w < reached; w++)
+        if (d.dom[w] != d.semi[w])
+            d.dom[w] = d.dom[d.dom[w]];
+
+    // a dominator is numbered before the nodes it dominates
+    for (u32 i = 0; i < n; i++)
+        retained[i] = snap->nodes[i].size;
+    for (u32 w = reached; w-- > 1; )
+        retained[d.vertex[d.dom[w]]] += retained[d.vertex[w]];
+
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++)
+        free(*arrays[i]);
+    free(number);
+    free(pred_starts);
+    free(preds);
+    free(bucket);
+    free(bucket_next);
+}
+
+static const u64 *sort_retained;
+
+static int by_retained(const void *a, const void *b)
+{
+    u64 x = sort_retained[*(const u32 *)a], y = sort_retained[*(const u32 *)b];
+    return (x < y) - (x > y);
+}
+
+// strings are grouped together, everything else by type and name
+typedef struct {
+    u8 type;
+    const char *name;
+    u32 count;
+    u64 size;
+} Group;
+
+static int by_size(const void *a, const void *b)
+{
+    u64 x = ((const Group *)a)->size, y = ((const Group *)b)->size;
+    return (x < y) - (x > y);
+}
+
+static void print_node(Snapshot *snap, u32 v)
+{
+    Node *node = &snap->nodes[v];
+    const char *type = snap->types[node->type];
+    if (strcmp(type, "string") == 0)
+        printf("%s \"%s\"\n", type, node->name);
+    else if (node->name[0] != '\0')
+        printf("%s %s\n", type, node->name);
+    else
+        printf("%s\n", type);
+}
+
+static void print_groups(Snapshot *snap, size_t count)
+{
+    Group *groups = alloc(snap->node_count, sizeof(Group));
+    size_t group_count = 0;
+    for (u32 v = 1; v < snap->node_count; v++) {
+        Node *node = &snap->nodes[v];
+        const char *name = strcmp(snap->types[node->type], "string") == 0 ? "" : node->name;
+        size_t g = 0;
+        while (g < group_count && !(groups[g].type == node->type && strcmp(groups[g].name, name) == 0))
+            g++;
+        if (g == group_count)
+            groups[group_count++] = (Group){ node->type, name, 0, 0 };
+        groups[g].count++;
+        groups[g].size += node->size;
+    }
+    qsort(groups, group_count, sizeof(Group), by_size);
+    printf("\n%12s %12s  by type\n", "objects", "bytes");
+    for (size_t g = 0; g < group_count && g < count; g++) {
+        printf("%12u %12llu  %s%s%s\n", groups[g].count, (unsigned long long)groups[g].size,
+            snap->types[groups[g].type], groups[g].name[0] != '\0' ? " " : "", groups[g].name);
+    }
+    free(groups);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: heapsnap file [count]\n");
+        return 1;
+    }
+    path = argv[1];
+    size_t count = argc == 3 ? strtoul(argv[2], NULL, 10) : 20;
+    file = fopen(path, "rb");
+    if (!file) {
+        perror("heapsnap");
+        return 1;
+    }
+    Snapshot snap;
+    read_snapshot(&snap);
+    fclose(file);
+
+    u64 *retained = alloc(snap.node_count, sizeof(u64));
+    retained_sizes(&snap, retained);
+
+    printf("%u objects, %u references, %llu bytes\n",
+        snap.node_count - 1, snap.edge_count, (unsigned long long)retained[0]);
+
+    u32 *sorted = alloc(snap.node_count, sizeof(u32));
+    for (u32 v = 0; v < snap.node_count; v++)
+        sorted[v] = v;
+    sort_retained = retained;
+    qsort(sorted + 1, snap.node_count - 1, sizeof(u32), by_retained);
+    printf("\n%12s %12s  largest retainers\n", "retained", "shallow");
+    for (u32 i = 1; i < snap.node_count && i <= count; i++) {
+        u32 v = sorted[i];
+        printf("%12llu %12u  ", (unsigned long long)retained[v], snap.nodes[v].size);
+        print_node(&snap, v);
+    }
+
+    print_groups(&snap, count);
+
+    free(sorted);
+    free(retained);
+    for (u32 i = 0; i < snap.type_count; i++)
+        free(snap.types[i]);
+    free(snap.types);
+    free(snap.nodes);
+    free(snap.edges);
+    free(snap.starts);
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * tablebench: times the operations of table.c on tables of growing size.
+ *
+ *     tablebench [max size]
+ *
+ * every size is timed over enough tables to make about two million
+ * operations of each kind: inserting n keys in random order, looking all
+ * of them up, looking up n keys that aren't there, finding them by their
+ * characters like the string interning does, and deleting them. the keys
+ * are made by hand, outside the heap, so the collector never sees them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include "uint.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define OPS_PER_SIZE 2000000
+#define OPS_PER_BATCH 10000
+
+static u64 now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u64 random_state = 0x9e3779b97f4a7c15ull;
+
+static u64 next_random()
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dull;
+}
+
+// what hash_string() would do for the key, near enough for a table
+static u32 mix(u64 x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return (u32)x;
+}
+
+static ObjString *make_key(size_t i)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "key%zu", i);
+    ObjString *key = malloc(offsetof(ObjString, data) + len + 1);
+    if (!key)
+        abort();
+    key->obj.type = OBJ_STRING;
+    key->len = len;
+    key->hash = mix(i);
+    key->selector = -1;
+    key->interned = true;
+    memcpy(key->data, buf, len + 1);
+    return key;
+}
+
+static void shuffle(ObjString **keys, size_t n)
+{
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = next_random() % (i + 1);
+        ObjString *tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+typedef struct {
+    u64 insert, lookup, miss, intern, delete;
+} Times;
+
+static size_t sink = 0;
+
+/* small tables are timed a batch at a time, so that reading the clock
+ * doesn't cost more than what it measures. */
+static void run_batch(Table *tabs, size_t count, ObjString **keys, ObjString **absent,
+                      size_t n, Times *t)
+{
+    Value value;
+    for (size_t b = 0; b < count; b++)
+        table_init(&tabs[b]);
+
+    u64 start = now();
+    for (size_t b = 0; b < count; b++)
+        for (size_t i = 0; i < n; i++)
+            table_install(&tabs[b], keys[i], VALUE_MKNUM(i));
+    u64 end = now();
+    t->insert += end - start;
+
+    start = now();
+    for (size_t b = 0; b < count; b++)
+        for (size_t i = 0; i < n; i++)
+            sink += table_lookup(&tabs[b], keys[n - 1 - i], &value);
+    end = now();
+    t->lookup += end - start;
+
+    start = now();
+    for (size_t b = 0; b < count; b++)
+        for (size_t i = 0; i < n; i++)
+            sink += table_lookup(&tabs[b], absent[i], &value);
+    end = now();
+    t->miss += end - start;
+
+    start = now();
+    for (size_t b = 0; b < count; b++) {
+        for (size_t i = 0; i < n; i++) {
+            ObjString *key = keys[i];
+            sink += table_find_string(&tabs[b], key->data, key->len, key->hash) != NULL;
+        }
+    }
+    end = now();
+    t->intern += end - start;
+
+    start = now();
+    for (size_t b = 0; b < count; b++)
+        for (size_t i = 0; i < n; i++)
+            sink += table_delete(&tabs[b], keys[i]);
+    end = now();
+    t->delete += end - start;
+
+    for (size_t b = 0; b < count; b++)
+        table_free(&tabs[b]);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {
+        4, 8, 16, 32, 64, 100, 1000, 10000, 100000, 1000000,
+    };
+    size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    vm_init();
+    printf("%10s %9s %9s %9s %9s %9s   ns per operation\n",
+        "size", "insert", "lookup", "miss", "intern", "delete");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= max; s++) {
+        size_t n = sizes[s];
+        ObjString **keys = malloc(sizeof(ObjString *) * n * 2);
+        if (!keys)
+            abort();
+        for (size_t i = 0; i < n * 2; i++)
+            keys[i] = make_key(i);
+        ObjString **absent = keys + n;
+        shuffle(keys, n);
+
+        size_t batch = n >= OPS_PER_BATCH ? 1 : OPS_PER_BATCH / n;
+        size_t rounds = n * batch >= OPS_PER_SIZE ? 1 : OPS_PER_SIZE / (n * batch);
+        Table *tabs = malloc(sizeof(Table) * batch);
+        if (!tabs)
+            abort();
+        Times t = { 0 };
+        for (size_t r = 0; r < rounds; r++)
+            run_batch(tabs, batch, keys, absent, n, &t);
+        free(tabs);
+        double ops = (double)rounds * batch * n;
+        printf("%10zu %9.1f %9.1f %9.1f %9.1f %9.1f\n", n,
+            t.insert / ops, t.lookup / ops, t.miss / ops, t.intern / ops, t.delete / ops);
+
+        for (size_t i = 0; i < n * 2; i++)
+            free(keys[i]);
+        free(keys);
+    }
+    vm_free();
+    return sink == 0;
+}
@@ -22,6 +22,7 @@ void value_print(Value value)
     case VAL_NIL:  printf("nil");                             break;
     case VAL_NUM:  printf("%g", AS_NUM(value));               break;
     case VAL_OBJ:  obj_print(value);                          break;
+    case VAL_UNDEF: printf("undefined");                      break;
     }
 #endif
 }
@@ -31,7 +32,9 @@ bool value_equal(Value a, Value b)
 #ifdef NAN_BOXING
     if (IS_NUM(a) && IS_NUM(b))
         return AS_NUM(a) == AS_NUM(b);
-    return a == b;
+    if (a == b)
+        return true;
+    return IS_OBJ(a) && IS_OBJ(b) && obj_text_equal(a, b);
 #else
     if (a.type != b.type)
         return false;
@@ -39,7 +42,9 @@ bool value_equal(Value a, Value b)
     case VAL_BOOL:  return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:   return true;
     case VAL_NUM:   return AS_NUM(a) == AS_NUM(b);
-    case VAL_OBJ:   return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+        return AS_OBJ(a) == AS_OBJ(b) || obj_text_equal(a, b);
+    case VAL_UNDEF: return true;
     default:        return false; // unreachable
     }
 #endif
@@ -10,6 +10,8 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjShape ObjShape;
 
 #ifdef NAN_BOXING
 
@@ -20,6 +22,7 @@ typedef u64 Value;
 #define TAG_NIL     1
 #define TAG_FALSE   2
 #define TAG_TRUE    3
+#define TAG_UNDEF   4
 
 static inline Value num_to_value(double num)
 {
@@ -42,9 +45,11 @@ static inline double value_to_num(Value value)
 #define VALUE_MKNIL()       ((Value)(u64)(QNAN | TAG_NIL))
 #define VALUE_MKNUM(value)  num_to_value(value)
 #define VALUE_MKOBJ(value)  (Value)(SIGN_BIT | QNAN | (u64)(uintptr_t)(value))
+#define VALUE_MKUNDEF()     ((Value)(u64)(QNAN | TAG_UNDEF))
 
 #define IS_BOOL(value)      (((value) | 1) == VALUE_TRUE)
 #define IS_NIL(value)       ((value) == VALUE_MKNIL())
+#define IS_UNDEF(value)     ((value) == VALUE_MKUNDEF())
 #define IS_NUM(value)       (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -59,6 +64,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUM,
     VAL_OBJ,
+    VAL_UNDEF,
 } ValueType;
 
 typedef struct Value {
@@ -74,6 +80,7 @@ typedef struct Value {
 #define VALUE_MKNIL()       ((Value) { VAL_NIL,  { .number  = 0           } })
 #define VALUE_MKNUM(value)  ((Value) { VAL_NUM,  { .number  = value       } })
 #define VALUE_MKOBJ(value)  ((Value) { VAL_OBJ,  { .obj     = (Obj*)value } })
+#define VALUE_MKUNDEF()     ((Value) { VAL_UNDEF, { .number = 0           } })
 
 #define AS_BOOL(value)      ((value).as.boolean)
 #define AS_NUM(value)       ((value).as.number)
@@ -83,6 +90,7 @@ typedef struct Value {
 #define IS_NIL(value)       ((value).type == VAL_NIL)
 #define IS_NUM(value)       ((value).type == VAL_NUM)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEF(value)     ((value).type == VAL_UNDEF)
 
 #endif // NAN_BOXING
 
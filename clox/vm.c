@@ -11,6 +11,22 @@
 #include "object.h"
 #include "memory.h"
 #include "debug.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "jit.h"
+
+// labels as values are a GNU extension
+#if defined(THREADED_DISPATCH) && !defined(__GNUC__)
+#undef THREADED_DISPATCH
+#endif
+
+// keeps rarely taken paths from being inlined into the ones they leave
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
 
 VM vm;
 
@@ -24,6 +40,7 @@ Value vm_pop()
     return *--vm.sp;
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
 static void print_stack()
 {
     printf("stack: ");
@@ -39,6 +56,17 @@ static void print_stack()
     }
 }
 
+static void trace_instr(CallFrame *frame)
+{
+    print_stack();
+    disassemble_opcode(
+        &frame->closure->fun->chunk,
+        (size_t)(frame->ip - frame->closure->fun->chunk.code)
+    );
+    printf("\n");
+}
+#endif
+
 static Value peek(size_t dist)
 {
     return vm.sp[-1 - dist];
@@ -51,14 +79,7 @@ static bool is_falsey(Value value)
 
 static void concat()
 {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
-    size_t len = a->len + b->len;
-    char *data = ALLOCATE(char, len+1);
-    memcpy(data,          a->data, a->len);
-    memcpy(data + a->len, b->data, b->len);
-    data[len] = '\0';
-    ObjString *result = obj_take_string(data, len);
+    Obj *result = obj_concat(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
     vm_pop();
     vm_pop();
     vm_push(VALUE_MKOBJ(result));
@@ -71,6 +92,9 @@ static void reset_stack()
     vm.open_upvalues = NULL;
 }
 
+// only the innermost and outermost of these many calls are printed
+#define TRACEBACK_MAX 64
+
 static void runtime_error(const char *fmt, ...)
 {
     CallFrame *frame = &vm.frames[vm.frame_size - 1];
@@ -85,7 +109,11 @@ static void runtime_error(const char *fmt, ...)
     fputs("\n", stderr);
 
     fprintf(stderr, "traceback:\n");
-    for (int i = vm.frame_size - 1; i >= 0; i--) {
+    for (long i = vm.frame_size - 1; i >= 0; i--) {
+        if (vm.frame_size > TRACEBACK_MAX && i == (long)vm.frame_size - TRACEBACK_MAX / 2 - 1) {
+            fprintf(stderr, "[... %zu more calls ...]\n", vm.frame_size - TRACEBACK_MAX);
+            i = TRACEBACK_MAX / 2 - 1;
+        }
         CallFrame *frame = &vm.frames[i];
         ObjFunction *fun = frame->closure->fun;
         size_t offset = frame->ip - fun->chunk.code - 1;
@@ -99,25 +127,114 @@ static void runtime_error(const char *fmt, ...)
     reset_stack();
 }
 
-static bool call(ObjClosure *closure, u8 argc)
+static void stack_panic(const char *what)
 {
-    if (argc != closure->fun->arity) {
-        runtime_error("expected %d arguments, got %d",
-            closure->fun->arity, argc);
-        return false;
+    fprintf(stderr, "panic: couldn't grow the %s stack\n", what);
+    exit(1);
+}
+
+/* makes the value stack hold at least the given number of values, past
+ * the reserve. a new stack is allocated rather than reallocated, so that
+ * the frames and open upvalues pointing into the old one can still be
+ * told where they were. */
+static void grow_values(size_t values)
+{
+    values += STACK_RESERVE;
+    if (values > vm.stack_cap) {
+        size_t cap = vm.stack_cap * 2;
+        while (cap < values)
+            cap *= 2;
+        Value *stack = malloc(sizeof(Value) * cap);
+        if (!stack)
+            stack_panic("value");
+        memcpy(stack, vm.stack, sizeof(Value) * (vm.sp - vm.stack));
+        for (size_t i = 0; i < vm.frame_size; i++)
+            vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+        for (ObjUpvalue *up = vm.open_upvalues; up != NULL; up = up->next)
+            up->location = stack + (up->location - vm.stack);
+        vm.sp = stack + (vm.sp - vm.stack);
+        free(vm.stack);
+        vm.stack = stack;
+        vm.stack_cap = cap;
+        vm.stack_limit = stack + cap - STACK_RESERVE;
     }
-    if (vm.frame_size == FRAMES_MAX) {
+}
+
+// makes room for one more frame, whose slots run up to the given number of values
+static NOINLINE bool grow_stack(size_t values)
+{
+    if (vm.frame_size == vm.frame_limit) {
         runtime_error("stack overflow");
         return false;
     }
+    if (vm.frame_size == vm.frame_cap) {
+        size_t cap = vm.frame_cap == 0 ? FRAMES_INITIAL : vm.frame_cap * 2;
+        vm.frame_cap = cap < vm.frame_limit ? cap : vm.frame_limit;
+        vm.frames = realloc(vm.frames, sizeof(CallFrame) * vm.frame_cap);
+        if (!vm.frames)
+            stack_panic("call");
+    }
+    grow_values(values);
+    return true;
+}
+
+// counts a call or a loop iteration, and compiles the function on the last
+static inline bool warm_up(ObjFunction *fun)
+{
+#ifdef JIT_ENABLED
+    if (fun->jit_countdown > 0 && --fun->jit_countdown == 0) {
+        jit_compile(fun);
+        return fun->jit != NULL;
+    }
+#endif
+    return false;
+}
+
+static inline bool call(ObjClosure *closure, u8 argc)
+{
+    ObjFunction *fun = closure->fun;
+    if (argc != fun->arity) {
+        runtime_error("expected %d arguments, got %d", fun->arity, argc);
+        return false;
+    }
+    if (vm.frame_size == vm.frame_cap || vm.sp - argc - 1 + fun->max_stack > vm.stack_limit) {
+        if (!grow_stack(vm.sp - argc - 1 + fun->max_stack - vm.stack))
+            return false;
+    }
     CallFrame *frame = &vm.frames[vm.frame_size++];
     frame->closure = closure;
-    frame->ip    = closure->fun->chunk.code;
+    frame->ip    = fun->chunk.code;
     frame->slots = vm.sp - argc - 1;
+    warm_up(fun);
+    return true;
+}
+
+static void close_upvalues(Value *last);
+
+/* a call in tail position: the callee and its arguments replace the
+ * running function's slots, and the callee takes over its frame. */
+static bool tail_call(ObjClosure *closure, u8 argc)
+{
+    ObjFunction *fun = closure->fun;
+    if (argc != fun->arity) {
+        runtime_error("expected %d arguments, got %d", fun->arity, argc);
+        return false;
+    }
+    CallFrame *frame = &vm.frames[vm.frame_size - 1];
+    close_upvalues(frame->slots);
+    memmove(frame->slots, vm.sp - argc - 1, sizeof(Value) * (argc + 1));
+    vm.sp = frame->slots + argc + 1;
+    if (frame->slots + fun->max_stack > vm.stack_limit) {
+        grow_values(frame->slots + fun->max_stack - vm.stack);
+    }
+    frame->closure = closure;
+    frame->ip = fun->chunk.code;
+    warm_up(fun);
     return true;
 }
 
-static bool call_value(Value callee, u8 argc)
+// natives, and classes without an initializer, never replace the frame
+static bool call_value(Value callee, u8 argc, bool tail)
 {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
@@ -130,13 +247,12 @@ static bool call_value(Value callee, u8 argc)
             vm_push(result);
             return true;
         case OBJ_CLOSURE:
-            return call(AS_CLOSURE(callee), argc);
+            return tail ? tail_call(AS_CLOSURE(callee), argc) : call(AS_CLOSURE(callee), argc);
         case OBJ_CLASS: {
             ObjClass *klass = AS_CLASS(callee);
             vm.sp[-argc-1] = VALUE_MKOBJ(obj_make_instance(klass));
-            Value ctor;
-            if (table_lookup(&klass->methods, vm.init_string, &ctor))
-                return call(AS_CLOSURE(ctor), argc);
+            if (klass->init != NULL)
+                return tail ? tail_call(klass->init, argc) : call(klass->init, argc);
             else if (argc != 0) {
                 runtime_error("expected 0 arguments, got %d", argc);
                 return false;
@@ -146,7 +262,7 @@ static bool call_value(Value callee, u8 argc)
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
             vm.sp[-argc-1] = bound->receiver;
-            return call(bound->method, argc);
+            return tail ? tail_call(bound->method, argc) : call(bound->method, argc);
         }
         }
         default:
@@ -157,17 +273,119 @@ static bool call_value(Value callee, u8 argc)
     return false;
 }
 
+static CacheEntry *cache_find(InlineCache *cache, ObjInstance *inst)
+{
+    for (int i = 0; i < cache->size; i++) {
+        CacheEntry *entry = &cache->entries[i];
+        if (entry->shape == inst->shape && entry->klass == inst->klass)
+            return entry;
+    }
+    return NULL;
+}
+
+static void cache_update(InlineCache *cache, CacheEntry entry)
+{
+    if (cache->megamorphic)
+        return;
+    // caches always belong to the running function
+    gc_write_barrier_all((Obj *)vm.frames[vm.frame_size - 1].closure->fun);
+    for (int i = 0; i < cache->size; i++) {
+        if (cache->entries[i].shape == entry.shape
+         && cache->entries[i].klass == entry.klass) {
+            cache->entries[i] = entry;
+            return;
+        }
+    }
+    if (cache->size == CACHE_ENTRIES) {
+        cache->megamorphic = true;
+        return;
+    }
+    cache->entries[cache->size++] = entry;
+}
+
+/* look up a property on an instance, trying the cache first. on success,
+ * *is_field tells whether value is a field or a method closure. */
+static bool lookup_property(ObjInstance *inst, ObjString *name,
+                            InlineCache *cache, Value *value, bool *is_field)
+{
+    if (!cache->megamorphic) {
+        CacheEntry *entry = cache_find(cache, inst);
+        if (entry != NULL) {
+            *is_field = entry->slot >= 0;
+            *value = *is_field ? *instance_field(inst, entry->slot)
+                               : entry->method;
+            return true;
+        }
+    }
+
+    // the shape tells both where a field is and that it's missing,
+    // so a method found here can't be shadowed by a field
+    CacheEntry entry = {
+        .klass      = inst->klass,
+        .shape      = inst->shape,
+        .next_shape = NULL,
+        .slot       = shape_find_slot(inst->shape, name),
+        .method     = VALUE_MKNIL(),
+    };
+    ObjClosure *method;
+    if (entry.slot != -1) {
+        *value = *instance_field(inst, entry.slot);
+        *is_field = true;
+    } else if ((method = class_method(inst->klass, name)) != NULL) {
+        entry.method = VALUE_MKOBJ(method);
+        *value = entry.method;
+        *is_field = false;
+    } else
+        return false;
+    cache_update(cache, entry);
+    return true;
+}
+
+static void set_property(ObjInstance *inst, ObjString *name,
+                         InlineCache *cache, Value value)
+{
+    if (!cache->megamorphic) {
+        CacheEntry *entry = cache_find(cache, inst);
+        if (entry != NULL) {
+            if (entry->next_shape != NULL)
+                instance_add_field(inst, entry->next_shape, value);
+            else {
+                *instance_field(inst, entry->slot) = value;
+                gc_write_barrier((Obj *)inst, value);
+            }
+            return;
+        }
+    }
+
+    CacheEntry entry = {
+        .klass      = inst->klass,
+        .shape      = inst->shape,
+        .next_shape = NULL,
+        .slot       = shape_find_slot(inst->shape, name),
+        .method     = VALUE_MKNIL(),
+    };
+    if (entry.slot != -1) {
+        *instance_field(inst, entry.slot) = value;
+        gc_write_barrier((Obj *)inst, value);
+    } else {
+        entry.next_shape = shape_add_field(inst->shape, name);
+        entry.slot = entry.next_shape->slot_count - 1;
+        instance_add_field(inst, entry.next_shape, value);
+    }
+    cache_update(cache, entry);
+}
+
 static bool invoke_from_class(ObjClass *klass, ObjString *name, u8 argc)
 {
-    Value method;
-    if (!table_lookup(&klass->methods, name, &method)) {
+    ObjClosure *method = class_method(klass, name);
+    if (method == NULL) {
         runtime_error("undefined property '%s'", name->data);
         return false;
     }
-    return call(AS_CLOSURE(method), argc);
+    return call(method, argc);
 }
 
-static bool invoke(ObjString *name, u8 argc)
+static bool invoke(ObjString *name, u8 argc, InlineCache *cache, bool tail)
 {
     Value receiver = peek(argc);
     if (!IS_INSTANCE(receiver)) {
@@ -177,11 +395,16 @@ static bool invoke(ObjString *name, u8 argc)
 
     ObjInstance *inst = AS_INSTANCE(receiver);
     Value value;
-    if (table_lookup(&inst->fields, name, &value)) {
+    bool is_field;
+    if (!lookup_property(inst, name, cache, &value, &is_field)) {
+        runtime_error("undefined property '%s'", name->data);
+        return false;
+    }
+    if (is_field) {
         vm.sp[-argc-1] = value;
-        return call_value(value, argc);
+        return call_value(value, argc, tail);
     }
-    return invoke_from_class(inst->klass, name, argc);
+    return tail ? tail_call(AS_CLOSURE(value), argc) : call(AS_CLOSURE(value), argc);
 }
 
 static ObjUpvalue *capture_upvalue(Value *local)
@@ -210,23 +433,22 @@ static void close_upvalues(Value *last)
         upvalue->closed   = *upvalue->location;
         upvalue->location = &upvalue->closed;
         vm.open_upvalues  = upvalue->next;
+        gc_write_barrier((Obj *)upvalue, upvalue->closed);
     }
 }
 
 static void define_method(ObjString *name)
 {
-    Value method = peek(0);
-    ObjClass *klass = AS_CLASS(peek(1));
-    table_install(&klass->methods, name, method);
+    class_add_method(AS_CLASS(peek(1)), name, AS_CLOSURE(peek(0)));
     vm_pop();
 }
 
 static bool bind_method(ObjClass *klass, ObjString *name)
 {
-    Value method;
-    if (!table_lookup(&klass->methods, name, &method))
+    ObjClosure *method = class_method(klass, name);
+    if (method == NULL)
         return false;
-    ObjBoundMethod *bound = obj_make_bound_method(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod *bound = obj_make_bound_method(peek(0), method);
     vm_pop();
     vm_push(VALUE_MKOBJ(bound));
     return true;
@@ -236,7 +458,8 @@ static void define_native(const char *name, NativeFn fun)
 {
     vm_push(VALUE_MKOBJ(obj_copy_string(name, strlen(name))));
     vm_push(VALUE_MKOBJ(obj_make_native(fun, name)));
-    table_install(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = vm_global_slot(AS_STRING(vm.stack[0]));
+    vm.global_values.values[slot] = vm.stack[1];
     vm_pop();
     vm_pop();
 }
@@ -246,6 +469,54 @@ static Value clock_native(int argc, Value *argv)
     return VALUE_MKNUM((double)clock() / CLOCKS_PER_SEC);
 }
 
+static void set_stat(ObjInstance *stats, const char *name, double value)
+{
+    vm_push(VALUE_MKOBJ(obj_copy_string(name, strlen(name))));
+    ObjShape *shape = shape_add_field(stats->shape, AS_STRING(peek(0)));
+    instance_add_field(stats, shape, VALUE_MKNUM(value));
+    vm_pop();
+}
+
+// the collector's counters, as the fields of a GCStats instance
+static Value gc_stats_native(int argc, Value *argv)
+{
+    static const char *pause_fields[GC_PAUSE_BUCKETS] = {
+        "pausesUnder10us", "pausesUnder100us", "pausesUnder1ms",
+        "pausesUnder10ms", "pausesUnder100ms", "pausesOver100ms",
+    };
+    GCStats *gc = &vm.gc_stats;
+    vm_push(VALUE_MKOBJ(obj_make_instance(vm.gc_stats_class)));
+    ObjInstance *stats = AS_INSTANCE(peek(0));
+    set_stat(stats, "collections",      gc->collections);
+    set_stat(stats, "minorCollections", gc->minor_pauses);
+    set_stat(stats, "compactions",      gc->compactions);
+    set_stat(stats, "bytesFreed",       gc->freed_bytes);
+    set_stat(stats, "bytesPromoted",    gc->promoted_bytes);
+    set_stat(stats, "heapBytes",        vm.bytes_allocated);
+    set_stat(stats, "nextCollection",   vm.next_gc);
+    set_stat(stats, "minorPauseTime",   gc->minor_time / 1e6);
+    set_stat(stats, "majorPauseTime",   gc->major_time / 1e6);
+    set_stat(stats, "maxMinorPause",    gc->max_minor_pause / 1e6);
+    set_stat(stats, "maxMajorPause",    gc->max_major_pause / 1e6);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+        set_stat(stats, pause_fields[i], gc->pause_histogram[i]);
+    return vm_pop();
+}
+
+// writes the objects reachable from the roots to a file, see snapshot.h
+static Value heap_snapshot_native(int argc, Value *argv)
+{
+    if (argc != 1 || !IS_TEXT(argv[0]))
+        return VALUE_MKBOOL(false);
+    return VALUE_MKBOOL(heap_snapshot(obj_flatten(AS_OBJ(argv[0]))->data));
+}
+
+void vm_jit_safepoint()
+{
+    gc_collect_young();
+    snapshot_if_requested();
+}
+
 static VMResult run()
 {
     CallFrame *frame = &vm.frames[vm.frame_size - 1];
@@ -256,86 +527,255 @@ static VMResult run()
 #define READ_CONSTANT() \
     (frame->closure->fun->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->fun->chunk.caches[READ_SHORT()])
 
-#define BINARY_OP(value_type, op)                       \
+/*
+ * quickening: a generic instruction rewrites itself into a variant
+ * specialized for the operand types it just saw. the variant only checks
+ * a cheap guard and, if that fails, turns the instruction back into the
+ * generic one and executes it again.
+ */
+#define QUICKEN(instr) (frame->ip[-1] = (instr))
+#define DEOPTIMIZE(instr)                               \
+    do {                                                \
+        frame->ip[-1] = (instr);                        \
+        frame->ip--;                                    \
+        DISPATCH();                                     \
+    } while (0)
+
+#define BINARY_OP(value_type, op, quick_instr)          \
     do {                                                \
         if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))) {     \
             runtime_error("operands must be numbers");  \
             return VM_RUNTIME_ERROR;                    \
         }                                               \
-        double b = AS_NUM(vm_pop());                       \
-        double a = AS_NUM(vm_pop());                       \
-        vm_push(value_type(a op b));                       \
+        QUICKEN(quick_instr);                           \
+        double b = AS_NUM(vm_pop());                    \
+        double a = AS_NUM(vm_pop());                    \
+        vm_push(value_type(a op b));                    \
+    } while (0)
+
+#define BINARY_OP_NUM(value_type, op, generic_instr)    \
+    do {                                                \
+        Value b = vm.sp[-1];                            \
+        Value a = vm.sp[-2];                            \
+        if (!IS_NUM(a) || !IS_NUM(b))                   \
+            DEOPTIMIZE(generic_instr);                  \
+        vm.sp[-2] = value_type(AS_NUM(a) op AS_NUM(b)); \
+        vm.sp--;                                        \
     } while (0)
 
-    for (;;) {
+// for the fused comparisons: cond is an expression over a and b
+#define COMPARE_OP(cond)                                \
+    do {                                                \
+        if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))) {     \
+            runtime_error("operands must be numbers");  \
+            return VM_RUNTIME_ERROR;                    \
+        }                                               \
+        double b = AS_NUM(vm_pop());                    \
+        double a = AS_NUM(vm_pop());                    \
+        vm_push(VALUE_MKBOOL(cond));                    \
+    } while (0)
+
+#define BRANCH_IF(cond)                                 \
+    do {                                                \
+        u16 offset = READ_SHORT();                      \
+        if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))) {     \
+            runtime_error("operands must be numbers");  \
+            return VM_RUNTIME_ERROR;                    \
+        }                                               \
+        double b = AS_NUM(vm.sp[-1]);                   \
+        double a = AS_NUM(vm.sp[-2]);                   \
+        vm.sp -= 2;                                     \
+        if (cond)                                       \
+            frame->ip += offset;                        \
+    } while (0)
+
+/*
+ * the nursery is only collected at backward branches and calls: objects
+ * move when it is, and in between them the handlers and the functions
+ * they call hold object pointers in C variables. heap snapshots asked for
+ * with SIGUSR2 are taken there too.
+ */
+#define SAFEPOINT()                                     \
+    do {                                                \
+        if (vm.gc_pending) {                            \
+            gc_collect_young();                         \
+            snapshot_if_requested();                    \
+        }                                               \
+    } while (0)
 
 #ifdef DEBUG_TRACE_EXECUTION
-        print_stack();
-        disassemble_opcode(
-            &frame->closure->fun->chunk,
-            (size_t)(frame->ip - frame->closure->fun->chunk.code)
-        );
-        printf("\n");
+#define TRACE_INSTR() trace_instr(frame)
+#else
+#define TRACE_INSTR() do { } while (0)
 #endif
 
-        u8 instr = READ_BYTE();
-        switch (instr) {
-        case OP_CONSTANT: {
+// after the frame changes: its function may have been compiled
+#ifdef JIT_ENABLED
+#define ENTER_JIT()                                     \
+    do {                                                \
+        if (frame->closure->fun->jit != NULL)           \
+            goto jit;                                   \
+    } while (0)
+#else
+#define ENTER_JIT() do { } while (0)
+#endif
+
+    /*
+     * with THREADED_DISPATCH every handler ends by jumping straight to the
+     * next handler through a table of label addresses, so each opcode gets
+     * its own indirect branch instead of sharing the one of the switch.
+     */
+#ifdef THREADED_DISPATCH
+    // labels as values are a GNU extension: let -pedantic pass over them,
+    // here and where DISPATCH() jumps, but nowhere else
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+    // every byte has an entry, so a corrupt opcode can't jump through NULL
+    static void *dispatch_table[256] = {
+        [0 ... 255]         = &&op_unknown,
+        [OP_CONSTANT]       = &&op_OP_CONSTANT,
+        [OP_NIL]            = &&op_OP_NIL,
+        [OP_TRUE]           = &&op_OP_TRUE,
+        [OP_FALSE]          = &&op_OP_FALSE,
+        [OP_POP]            = &&op_OP_POP,
+        [OP_DEFINE_GLOBAL]  = &&op_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]     = &&op_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]     = &&op_OP_SET_GLOBAL,
+        [OP_GET_LOCAL]      = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL]      = &&op_OP_SET_LOCAL,
+        [OP_GET_UPVALUE]    = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]    = &&op_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY]   = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]   = &&op_OP_SET_PROPERTY,
+        [OP_GET_SUPER]      = &&op_OP_GET_SUPER,
+        [OP_EQ]             = &&op_OP_EQ,
+        [OP_GREATER]        = &&op_OP_GREATER,
+        [OP_LESS]           = &&op_OP_LESS,
+        [OP_ADD]            = &&op_OP_ADD,
+        [OP_SUB]            = &&op_OP_SUB,
+        [OP_MUL]            = &&op_OP_MUL,
+        [OP_DIV]            = &&op_OP_DIV,
+        [OP_NOT]            = &&op_OP_NOT,
+        [OP_NEGATE]         = &&op_OP_NEGATE,
+        [OP_PRINT]          = &&op_OP_PRINT,
+        [OP_BRANCH]         = &&op_OP_BRANCH,
+        [OP_BRANCH_FALSE]   = &&op_OP_BRANCH_FALSE,
+        [OP_BRANCH_BACK]    = &&op_OP_BRANCH_BACK,
+        [OP_CALL]           = &&op_OP_CALL,
+        [OP_INVOKE]         = &&op_OP_INVOKE,
+        [OP_SUPER_INVOKE]   = &&op_OP_SUPER_INVOKE,
+        [OP_TAIL_CALL]      = &&op_OP_TAIL_CALL,
+        [OP_TAIL_INVOKE]    = &&op_OP_TAIL_INVOKE,
+        [OP_RETURN]         = &&op_OP_RETURN,
+        [OP_CLOSURE]        = &&op_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE]  = &&op_OP_CLOSE_UPVALUE,
+        [OP_CLASS]          = &&op_OP_CLASS,
+        [OP_METHOD]         = &&op_OP_METHOD,
+        [OP_INHERIT]        = &&op_OP_INHERIT,
+        [OP_GET_LOCAL2]     = &&op_OP_GET_LOCAL2,
+        [OP_INC_LOCAL]      = &&op_OP_INC_LOCAL,
+        [OP_NOT_EQ]         = &&op_OP_NOT_EQ,
+        [OP_LESS_EQ]        = &&op_OP_LESS_EQ,
+        [OP_GREATER_EQ]     = &&op_OP_GREATER_EQ,
+        [OP_BRANCH_NOT_LESS]        = &&op_OP_BRANCH_NOT_LESS,
+        [OP_BRANCH_NOT_GREATER]     = &&op_OP_BRANCH_NOT_GREATER,
+        [OP_BRANCH_NOT_LESS_EQ]     = &&op_OP_BRANCH_NOT_LESS_EQ,
+        [OP_BRANCH_NOT_GREATER_EQ]  = &&op_OP_BRANCH_NOT_GREATER_EQ,
+        [OP_ADD_NUM]        = &&op_OP_ADD_NUM,
+        [OP_ADD_STR]        = &&op_OP_ADD_STR,
+        [OP_SUB_NUM]        = &&op_OP_SUB_NUM,
+        [OP_MUL_NUM]        = &&op_OP_MUL_NUM,
+        [OP_DIV_NUM]        = &&op_OP_DIV_NUM,
+        [OP_GREATER_NUM]    = &&op_OP_GREATER_NUM,
+        [OP_LESS_NUM]       = &&op_OP_LESS_NUM,
+        [OP_GET_FIELD]      = &&op_OP_GET_FIELD,
+    };
+#pragma GCC diagnostic pop
+#define INTERPRET_LOOP DISPATCH();
+#define DISPATCH()                                       \
+    do {                                                 \
+        TRACE_INSTR();                                   \
+        _Pragma("GCC diagnostic push")                   \
+        _Pragma("GCC diagnostic ignored \"-Wpedantic\"") \
+        goto *dispatch_table[READ_BYTE()];               \
+        _Pragma("GCC diagnostic pop")                    \
+    } while (0)
+#define CASE(op) op_##op:
+#else
+#define INTERPRET_LOOP \
+    u8 instr;          \
+    loop:              \
+    TRACE_INSTR();     \
+    switch (instr = READ_BYTE())
+#define DISPATCH() goto loop
+#define CASE(op) case op:
+#endif
+
+    ENTER_JIT();
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT) {
             Value constant = READ_CONSTANT();
             vm_push(constant);
-            break;
+            DISPATCH();
         }
-        case OP_NIL:    vm_push(VALUE_MKNIL());       break;
-        case OP_TRUE:   vm_push(VALUE_MKBOOL(true));  break;
-        case OP_FALSE:  vm_push(VALUE_MKBOOL(false)); break;
-        case OP_POP:    vm_pop();                     break;
-        case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
-            table_install(&vm.globals, name, peek(0));
+        CASE(OP_NIL)    vm_push(VALUE_MKNIL());       DISPATCH();
+        CASE(OP_TRUE)   vm_push(VALUE_MKBOOL(true));  DISPATCH();
+        CASE(OP_FALSE)  vm_push(VALUE_MKBOOL(false)); DISPATCH();
+        CASE(OP_POP)    vm_pop();                     DISPATCH();
+        CASE(OP_DEFINE_GLOBAL) {
+            u16 slot = READ_SHORT();
+            vm.global_values.values[slot] = peek(0);
             vm_pop();
-            break;
+            DISPATCH();
         }
-        case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!table_lookup(&vm.globals, name, &value)) {
-                runtime_error("undefined variable '%s'", name->data);
+        CASE(OP_GET_GLOBAL) {
+            u16 slot = READ_SHORT();
+            Value value = vm.global_values.values[slot];
+            if (IS_UNDEF(value)) {
+                runtime_error("undefined variable '%s'",
+                              AS_CSTRING(vm.global_names.values[slot]));
                 return VM_RUNTIME_ERROR;
             }
             vm_push(value);
-            break;
+            DISPATCH();
         }
-        case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            if (table_install(&vm.globals, name, peek(0))) {
-                table_delete(&vm.globals, name);
-                runtime_error("undefined variable '%s'", name->data);
+        CASE(OP_SET_GLOBAL) {
+            u16 slot = READ_SHORT();
+            if (IS_UNDEF(vm.global_values.values[slot])) {
+                runtime_error("undefined variable '%s'",
+                              AS_CSTRING(vm.global_names.values[slot]));
                 return VM_RUNTIME_ERROR;
             }
-            break;
+            vm.global_values.values[slot] = peek(0);
+            DISPATCH();
         }
-        case OP_GET_LOCAL: {
+        CASE(OP_GET_LOCAL) {
             u8 slot = READ_BYTE();
             vm_push(frame->slots[slot]);
-            break;
+            DISPATCH();
         }
-        case OP_SET_LOCAL: {
+        CASE(OP_SET_LOCAL) {
             u8 slot = READ_BYTE();
             frame->slots[slot] = peek(0);
-            break;
+            DISPATCH();
         }
-        case OP_GET_UPVALUE: {
+        CASE(OP_GET_UPVALUE) {
             u8 slot = READ_BYTE();
             vm_push(*frame->closure->upvalues[slot]->location);
-            break;
+            DISPATCH();
         }
-        case OP_SET_UPVALUE: {
+        CASE(OP_SET_UPVALUE) {
             u8 slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+            ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = peek(0);
+            gc_write_barrier((Obj *)upvalue, peek(0));
+            DISPATCH();
         }
-        case OP_GET_PROPERTY: {
+        CASE(OP_GET_PROPERTY) {
             if (!IS_INSTANCE(peek(0))) {
                 runtime_error("attempt to get a property from a non-instance value");
                 return VM_RUNTIME_ERROR;
@@ -343,51 +783,57 @@ static VMResult run()
 
             ObjInstance *inst = AS_INSTANCE(peek(0));
             ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
             Value value;
-            // field?
-            if (table_lookup(&inst->fields, name, &value)) {
-                vm_pop();
-                vm_push(value);
-                break;
+            bool is_field;
+            if (!lookup_property(inst, name, cache, &value, &is_field)) {
+                runtime_error("undefined property '%s'", name->data);
+                return VM_RUNTIME_ERROR;
             }
-            // method?
-            if (bind_method(inst->klass, name))
-                break;
-
-            runtime_error("undefined property '%s'", name->data);
-            return VM_RUNTIME_ERROR;
+            if (!is_field)
+                value = VALUE_MKOBJ(obj_make_bound_method(peek(0), AS_CLOSURE(value)));
+            else if (cache->size == 1 && !cache->megamorphic)
+                frame->ip[-4] = OP_GET_FIELD;
+            vm_pop();
+            vm_push(value);
+            DISPATCH();
         }
-        case OP_SET_PROPERTY: {
+        CASE(OP_SET_PROPERTY) {
             if (!IS_INSTANCE(peek(1))) {
                 runtime_error("attempt to get a property from a non-instance value");
                 return VM_RUNTIME_ERROR;
             }
             ObjInstance *inst = AS_INSTANCE(peek(1));
-            table_install(&inst->fields, READ_STRING(), peek(0));
+            ObjString *name = READ_STRING();
+            set_property(inst, name, READ_CACHE(), peek(0));
             Value value = vm_pop();
             vm_pop();
             vm_push(value);
-            break;
+            DISPATCH();
         }
-        case OP_GET_SUPER: {
+        CASE(OP_GET_SUPER) {
             ObjString *name = READ_STRING();
             ObjClass *superclass = AS_CLASS(vm_pop());
             if (!bind_method(superclass, name))
                 return VM_RUNTIME_ERROR;
-            break;
+            DISPATCH();
         }
-        case OP_EQ: {
-            Value b = vm_pop();
-            Value a = vm_pop();
-            vm_push(VALUE_MKBOOL(value_equal(a, b)));
-            break;
+        CASE(OP_EQ) {
+            // flattening a rope allocates, so the operands stay on the stack
+            bool equal = value_equal(peek(1), peek(0));
+            vm_pop();
+            vm_pop();
+            vm_push(VALUE_MKBOOL(equal));
+            DISPATCH();
         }
-        case OP_GREATER: BINARY_OP(VALUE_MKBOOL, >); break;
-        case OP_LESS:    BINARY_OP(VALUE_MKBOOL, <); break;
-        case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+        CASE(OP_GREATER) BINARY_OP(VALUE_MKBOOL, >, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_LESS)    BINARY_OP(VALUE_MKBOOL, <, OP_LESS_NUM);    DISPATCH();
+        CASE(OP_ADD)
+            if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+                QUICKEN(OP_ADD_STR);
                 concat();
-            else if (IS_NUM(peek(0)) && IS_NUM(peek(1))) {
+            } else if (IS_NUM(peek(0)) && IS_NUM(peek(1))) {
+                QUICKEN(OP_ADD_NUM);
                 double b = AS_NUM(vm_pop());
                 double a = AS_NUM(vm_pop());
                 vm_push(VALUE_MKNUM(a + b));
@@ -395,65 +841,96 @@ static VMResult run()
                 runtime_error("operands must be two numbers or two strings");
                 return VM_RUNTIME_ERROR;
             }
-            break;
-        case OP_SUB:    BINARY_OP(VALUE_MKNUM, -); break;
-        case OP_MUL:    BINARY_OP(VALUE_MKNUM, *); break;
-        case OP_DIV:    BINARY_OP(VALUE_MKNUM, /); break;
-        case OP_NOT:
+            DISPATCH();
+        CASE(OP_SUB)    BINARY_OP(VALUE_MKNUM, -, OP_SUB_NUM); DISPATCH();
+        CASE(OP_MUL)    BINARY_OP(VALUE_MKNUM, *, OP_MUL_NUM); DISPATCH();
+        CASE(OP_DIV)    BINARY_OP(VALUE_MKNUM, /, OP_DIV_NUM); DISPATCH();
+        CASE(OP_NOT)
             vm_push(VALUE_MKBOOL(is_falsey(vm_pop())));
-            break;
-        case OP_NEGATE:
+            DISPATCH();
+        CASE(OP_NEGATE)
             if (!IS_NUM(peek(0))) {
                 runtime_error("operand must be a number");
                 return VM_RUNTIME_ERROR;
             }
             vm_push(VALUE_MKNUM(-AS_NUM(vm_pop())));
-            break;
-        case OP_PRINT:
+            DISPATCH();
+        CASE(OP_PRINT)
             value_print(vm_pop());
             printf("\n");
-            break;
-        case OP_BRANCH: {
+            DISPATCH();
+        CASE(OP_BRANCH) {
             u16 offset = READ_SHORT();
             frame->ip += offset;
-            break;
+            DISPATCH();
         }
-        case OP_BRANCH_FALSE: {
+        CASE(OP_BRANCH_FALSE) {
             u16 offset = READ_SHORT();
             if (is_falsey(peek(0)))
                 frame->ip += offset;
-            break;
+            DISPATCH();
         }
-        case OP_BRANCH_BACK: {
+        CASE(OP_BRANCH_BACK) {
             u16 offset = READ_SHORT();
             frame->ip -= offset;
-            break;
+            SAFEPOINT();
+            // a hot loop goes on in machine code from its next iteration
+            if (warm_up(frame->closure->fun))
+                ENTER_JIT();
+            DISPATCH();
         }
-        case OP_CALL: {
+        CASE(OP_CALL) {
             u8 argc = READ_BYTE();
-            if (!call_value(peek(argc), argc))
+            if (!call_value(peek(argc), argc, false))
                 return VM_RUNTIME_ERROR;
             frame = &vm.frames[vm.frame_size - 1];
-            break;
+            SAFEPOINT();
+            ENTER_JIT();
+            DISPATCH();
         }
-        case OP_INVOKE: {
+        CASE(OP_INVOKE) {
             ObjString *method = READ_STRING();
             u8 argc = READ_BYTE();
-            if (!invoke(method, argc))
+            InlineCache *cache = READ_CACHE();
+            if (!invoke(method, argc, cache, false))
                 return VM_RUNTIME_ERROR;
             frame = &vm.frames[vm.frame_size-1];
-            break;
+            SAFEPOINT();
+            ENTER_JIT();
+            DISPATCH();
         }
-        case OP_SUPER_INVOKE: {
+        // the frame stays where it is: only its function changes, or
+        // nothing does and the return after the call runs next
+        CASE(OP_TAIL_CALL) {
+            u8 argc = READ_BYTE();
+            if (!call_value(peek(argc), argc, true))
+                return VM_RUNTIME_ERROR;
+            SAFEPOINT();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_INVOKE) {
+            ObjString *method = READ_STRING();
+            u8 argc = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            if (!invoke(method, argc, cache, true))
+                return VM_RUNTIME_ERROR;
+            SAFEPOINT();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE) {
             ObjString *method = READ_STRING();
             u8 argc = READ_BYTE();
             ObjClass *superclass = AS_CLASS(vm_pop());
             if (!invoke_from_class(superclass, method, argc))
                 return VM_RUNTIME_ERROR;
             frame = &vm.frames[vm.frame_size-1];
-            break;
+            SAFEPOINT();
+            ENTER_JIT();
+            DISPATCH();
         }
-        case OP_RETURN: {
+        CASE(OP_RETURN) {
             Value result = vm_pop();
             close_upvalues(frame->slots);
             vm.frame_size--;
@@ -463,10 +940,11 @@ static VMResult run()
             }
             vm.sp = frame->slots;
             vm_push(result);
-            frame = &vm.frames[vm.frame_size-1];
-            break;
+            frame--;    // the frames only move when a call grows them
+            ENTER_JIT();
+            DISPATCH();
         }
-        case OP_CLOSURE: {
+        CASE(OP_CLOSURE) {
             ObjFunction *fun = AS_FUNCTION(READ_CONSTANT());
             ObjClosure *closure = obj_make_closure(fun);
             vm_push(VALUE_MKOBJ(closure));
@@ -478,62 +956,378 @@ static VMResult run()
                 else
                     closure->upvalues[i] = frame->closure->upvalues[index];
             }
-            break;
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE:
+        CASE(OP_CLOSE_UPVALUE)
             close_upvalues(vm.sp - 1);
             vm_pop();
-            break;
-        case OP_CLASS:
+            DISPATCH();
+        CASE(OP_CLASS)
             vm_push(VALUE_MKOBJ(obj_make_class(READ_STRING())));
-            break;
-        case OP_METHOD:
+            DISPATCH();
+        CASE(OP_METHOD)
             define_method(READ_STRING());
-            break;
-        case OP_INHERIT: {
+            DISPATCH();
+        CASE(OP_INHERIT) {
             Value superclass = peek(1);
             if (!IS_CLASS(superclass)) {
                 runtime_error("superclass must be a class");
                 return VM_RUNTIME_ERROR;
             }
-            ObjClass *subclass = AS_CLASS(peek(0));
-            table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-            break;
+            class_inherit(AS_CLASS(peek(0)), AS_CLASS(superclass));
+            vm_pop();
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL2) {
+            u8 a = READ_BYTE();
+            u8 b = READ_BYTE();
+            vm.sp[0] = frame->slots[a];
+            vm.sp[1] = frame->slots[b];
+            vm.sp += 2;
+            DISPATCH();
+        }
+        CASE(OP_INC_LOCAL) {
+            Value *local = &frame->slots[READ_BYTE()];
+            Value k = READ_CONSTANT();
+            if (!IS_NUM(*local)) {
+                runtime_error("operands must be two numbers or two strings");
+                return VM_RUNTIME_ERROR;
+            }
+            *local = VALUE_MKNUM(AS_NUM(*local) + AS_NUM(k));
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQ) {
+            bool equal = value_equal(peek(1), peek(0));
+            vm_pop();
+            vm_pop();
+            vm_push(VALUE_MKBOOL(!equal));
+            DISPATCH();
+        }
+        // these keep the semantics of the pairs they replace, nan included
+        CASE(OP_LESS_EQ)    COMPARE_OP(!(a > b)); DISPATCH();
+        CASE(OP_GREATER_EQ) COMPARE_OP(!(a < b)); DISPATCH();
+        CASE(OP_BRANCH_NOT_LESS)       BRANCH_IF(!(a < b)); DISPATCH();
+        CASE(OP_BRANCH_NOT_GREATER)    BRANCH_IF(!(a > b)); DISPATCH();
+        CASE(OP_BRANCH_NOT_LESS_EQ)    BRANCH_IF(a > b);    DISPATCH();
+        CASE(OP_BRANCH_NOT_GREATER_EQ) BRANCH_IF(a < b);    DISPATCH();
+        CASE(OP_ADD_NUM) BINARY_OP_NUM(VALUE_MKNUM,  +, OP_ADD); DISPATCH();
+        CASE(OP_ADD_STR)
+            if (!IS_TEXT(peek(0)) || !IS_TEXT(peek(1)))
+                DEOPTIMIZE(OP_ADD);
+            concat();
+            DISPATCH();
+        CASE(OP_SUB_NUM) BINARY_OP_NUM(VALUE_MKNUM,  -, OP_SUB); DISPATCH();
+        CASE(OP_MUL_NUM) BINARY_OP_NUM(VALUE_MKNUM,  *, OP_MUL); DISPATCH();
+        CASE(OP_DIV_NUM) BINARY_OP_NUM(VALUE_MKNUM,  /, OP_DIV); DISPATCH();
+        CASE(OP_GREATER_NUM) BINARY_OP_NUM(VALUE_MKBOOL, >, OP_GREATER); DISPATCH();
+        CASE(OP_LESS_NUM)    BINARY_OP_NUM(VALUE_MKBOOL, <, OP_LESS);    DISPATCH();
+        CASE(OP_GET_FIELD) {
+            // a monomorphic field load: the shape alone says where it is
+            u8 *start = frame->ip - 1;
+            frame->ip++;
+            CacheEntry *entry = &READ_CACHE()->entries[0];
+            Value receiver = peek(0);
+            if (!IS_INSTANCE(receiver)
+             || AS_INSTANCE(receiver)->shape != entry->shape) {
+                *start = OP_GET_PROPERTY;
+                frame->ip = start;
+                DISPATCH();
+            }
+            vm.sp[-1] = *instance_field(AS_INSTANCE(receiver), entry->slot);
+            DISPATCH();
         }
+#ifdef THREADED_DISPATCH
+        op_unknown:
+            runtime_error("unknown opcode: %d", frame->ip[-1]);
+            return VM_RUNTIME_ERROR;
+#else
         default:
             runtime_error("unknown opcode: %d", instr);
             return VM_RUNTIME_ERROR;
-        }
+#endif
     }
 
+#ifdef JIT_ENABLED
+    // compiled code runs until the frame changes, see jit.h
+jit:
+    switch (jit_enter(frame)) {
+    case JIT_FRAME:
+        frame = &vm.frames[vm.frame_size - 1];
+        ENTER_JIT();
+        DISPATCH();
+    case JIT_DONE:
+        return VM_OK;
+    case JIT_NEXT:
+    case JIT_ERROR:
+        break;
+    }
+#endif
+
+    return VM_RUNTIME_ERROR;
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef QUICKEN
+#undef DEOPTIMIZE
 #undef BINARY_OP
+#undef BINARY_OP_NUM
+#undef COMPARE_OP
+#undef BRANCH_IF
+#undef SAFEPOINT
+#undef TRACE_INSTR
+#undef ENTER_JIT
+#undef INTERPRET_LOOP
+#undef DISPATCH
+#undef CASE
 }
 
+#ifdef JIT_ENABLED
+/*
+ * what compiled code leaves to the vm: the instructions it has no template
+ * for, and the ones whose operands weren't what their template expects.
+ * those only get here to fail, or for what numbers don't do.
+ * frame->ip is already past the instruction, as runtime_error() wants it.
+ */
+JitStatus vm_jit_exec(u8 *instr)
+{
+    CallFrame *frame = &vm.frames[vm.frame_size - 1];
+    Chunk *chunk = &frame->closure->fun->chunk;
+    size_t frame_size = vm.frame_size;
+    u8 *ip = frame->ip;
+
+    switch (*instr) {
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL: {
+        u16 operand = (u16)(instr[1] << 8 | instr[2]);
+        runtime_error("undefined variable '%s'",
+                      AS_CSTRING(vm.global_names.values[operand]));
+        return JIT_ERROR;
+    }
+    case OP_SET_UPVALUE: {
+        ObjUpvalue *upvalue = frame->closure->upvalues[instr[1]];
+        *upvalue->location = peek(0);
+        gc_write_barrier((Obj *)upvalue, peek(0));
+        return JIT_NEXT;
+    }
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD: {
+        if (!IS_INSTANCE(peek(0))) {
+            runtime_error("attempt to get a property from a non-instance value");
+            return JIT_ERROR;
+        }
+        ObjInstance *inst = AS_INSTANCE(peek(0));
+        ObjString *name = AS_STRING(chunk->constants.values[instr[1]]);
+        InlineCache *cache = &chunk->caches[instr[2] << 8 | instr[3]];
+        Value value;
+        bool is_field;
+        if (!lookup_property(inst, name, cache, &value, &is_field)) {
+            runtime_error("undefined property '%s'", name->data);
+            return JIT_ERROR;
+        }
+        if (!is_field)
+            value = VALUE_MKOBJ(obj_make_bound_method(peek(0), AS_CLOSURE(value)));
+        vm.sp[-1] = value;
+        return JIT_NEXT;
+    }
+    case OP_SET_PROPERTY: {
+        if (!IS_INSTANCE(peek(1))) {
+            runtime_error("attempt to get a property from a non-instance value");
+            return JIT_ERROR;
+        }
+        ObjString *name = AS_STRING(chunk->constants.values[instr[1]]);
+        InlineCache *cache = &chunk->caches[instr[2] << 8 | instr[3]];
+        set_property(AS_INSTANCE(peek(1)), name, cache, peek(0));
+        Value value = vm_pop();
+        vm.sp[-1] = value;
+        return JIT_NEXT;
+    }
+    case OP_GET_SUPER: {
+        ObjString *name = AS_STRING(chunk->constants.values[instr[1]]);
+        ObjClass *superclass = AS_CLASS(vm_pop());
+        return bind_method(superclass, name) ? JIT_NEXT : JIT_ERROR;
+    }
+    case OP_EQ:
+    case OP_NOT_EQ: {
+        bool equal = value_equal(peek(1), peek(0));
+        vm_pop();
+        vm.sp[-1] = VALUE_MKBOOL(*instr == OP_EQ ? equal : !equal);
+        return JIT_NEXT;
+    }
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+            concat();
+            return JIT_NEXT;
+        }
+        // fall through
+    case OP_INC_LOCAL:
+        runtime_error("operands must be two numbers or two strings");
+        return JIT_ERROR;
+    case OP_SUB:
+    case OP_SUB_NUM:
+    case OP_MUL:
+    case OP_MUL_NUM:
+    case OP_DIV:
+    case OP_DIV_NUM:
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_LESS_EQ:
+    case OP_GREATER_EQ:
+    case OP_BRANCH_NOT_LESS:
+    case OP_BRANCH_NOT_GREATER:
+    case OP_BRANCH_NOT_LESS_EQ:
+    case OP_BRANCH_NOT_GREATER_EQ:
+        runtime_error("operands must be numbers");
+        return JIT_ERROR;
+    case OP_NEGATE:
+        runtime_error("operand must be a number");
+        return JIT_ERROR;
+    case OP_PRINT:
+        value_print(vm_pop());
+        printf("\n");
+        return JIT_NEXT;
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+        u8 argc = instr[1];
+        if (!call_value(peek(argc), argc, *instr == OP_TAIL_CALL))
+            return JIT_ERROR;
+        break;
+    }
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE: {
+        ObjString *method = AS_STRING(chunk->constants.values[instr[1]]);
+        u8 argc = instr[2];
+        InlineCache *cache = &chunk->caches[instr[3] << 8 | instr[4]];
+        if (!invoke(method, argc, cache, *instr == OP_TAIL_INVOKE))
+            return JIT_ERROR;
+        break;
+    }
+    case OP_SUPER_INVOKE: {
+        ObjString *method = AS_STRING(chunk->constants.values[instr[1]]);
+        ObjClass *superclass = AS_CLASS(vm_pop());
+        if (!invoke_from_class(superclass, method, instr[2]))
+            return JIT_ERROR;
+        break;
+    }
+    case OP_RETURN: {
+        Value result = vm_pop();
+        close_upvalues(frame->slots);
+        vm.frame_size--;
+        if (vm.frame_size == 0) {
+            vm_pop();
+            return JIT_DONE;
+        }
+        vm.sp = frame->slots;
+        vm_push(result);
+        return JIT_FRAME;
+    }
+    case OP_CLOSURE: {
+        ObjFunction *fun = AS_FUNCTION(chunk->constants.values[instr[1]]);
+        ObjClosure *closure = obj_make_closure(fun);
+        vm_push(VALUE_MKOBJ(closure));
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            u8 is_local = instr[2 + i * 2];
+            u8 index    = instr[3 + i * 2];
+            if (is_local)
+                closure->upvalues[i] = capture_upvalue(frame->slots + index);
+            else
+                closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        return JIT_NEXT;
+    }
+    case OP_CLOSE_UPVALUE:
+        close_upvalues(vm.sp - 1);
+        vm_pop();
+        return JIT_NEXT;
+    case OP_CLASS:
+        vm_push(VALUE_MKOBJ(obj_make_class(AS_STRING(chunk->constants.values[instr[1]]))));
+        return JIT_NEXT;
+    case OP_METHOD:
+        define_method(AS_STRING(chunk->constants.values[instr[1]]));
+        return JIT_NEXT;
+    case OP_INHERIT:
+        if (!IS_CLASS(peek(1))) {
+            runtime_error("superclass must be a class");
+            return JIT_ERROR;
+        }
+        class_inherit(AS_CLASS(peek(0)), AS_CLASS(peek(1)));
+        vm_pop();
+        return JIT_NEXT;
+    default:
+        runtime_error("unknown opcode: %d", *instr);
+        return JIT_ERROR;
+    }
+
+    // a call: the callee's frame, or the one a tail call took over, runs next
+    if (vm.gc_pending)
+        vm_jit_safepoint();
+    return vm.frame_size != frame_size || frame->ip != ip ? JIT_FRAME : JIT_NEXT;
+}
+#endif
+
 void vm_init()
 {
+    vm.frames = NULL;
+    vm.frame_cap = 0;
+    vm.frame_limit = CALL_DEPTH_DEFAULT;
+    vm.stack = malloc(sizeof(Value) * STACK_INITIAL);
+    if (!vm.stack)
+        stack_panic("value");
+    vm.stack_cap = STACK_INITIAL;
+    vm.stack_limit = vm.stack + STACK_INITIAL - STACK_RESERVE;
     reset_stack();
-    vm.objects = NULL;
+#ifdef JIT_ENABLED
+    vm.jit = true;
+#else
+    vm.jit = false;
+#endif
     vm.bytes_allocated = 0;
-    vm.next_gc = 1024 * 1024;
-    table_init(&vm.globals);
+    graystack_init(&vm.gray_stack);
+    gc_init();
+    vm.next_gc = vm.gc_initial_heap;
+    table_init(&vm.global_slots);
+    valuearray_init(&vm.global_names);
+    valuearray_init(&vm.global_values);
     table_init(&vm.strings);
+    valuearray_init(&vm.selectors);
     vm.init_string = NULL;
     vm.init_string = obj_copy_string("init", 4);
-    graystack_init(&vm.gray_stack);
+    vm.empty_shape = NULL;
+    vm.empty_shape = obj_make_shape(NULL, NULL);
+    vm.gc_stats_class = NULL;
+    vm_push(VALUE_MKOBJ(obj_copy_string("GCStats", 7)));
+    vm.gc_stats_class = obj_make_class(AS_STRING(peek(0)));
+    vm_pop();
     define_native("clock", clock_native);
+    define_native("gcStats", gc_stats_native);
+    define_native("heapSnapshot", heap_snapshot_native);
+    snapshot_init();
 }
 
 void vm_free()
 {
-    table_free(&vm.globals);
+    table_free(&vm.global_slots);
+    valuearray_free(&vm.global_names);
+    valuearray_free(&vm.global_values);
     table_free(&vm.strings);
-    obj_free_arr(vm.objects);
+    valuearray_free(&vm.selectors);
+    gc_free();
+    pool_free_all();
+    profile_free();
     vm.init_string = NULL;
+    vm.empty_shape = NULL;
+    vm.gc_stats_class = NULL;
     free(vm.gray_stack.stack);
+    free(vm.frames);
+    free(vm.stack);
+    vm.frames = NULL;
+    vm.stack = NULL;
 }
 
 VMResult vm_interpret(const char *src, const char *filename)
@@ -555,6 +1349,22 @@ VMResult vm_interpret(const char *src, const char *filename)
     return run();
 }
 
+/* globals live in vm.global_values, at a slot the compiler assigns the
+ * first time it sees their name. a slot holds an undefined value until
+ * its variable gets defined. */
+int vm_global_slot(ObjString *name)
+{
+    Value slot;
+    if (table_lookup(&vm.global_slots, name, &slot))
+        return (int) AS_NUM(slot);
+    vm_push(VALUE_MKOBJ(name));
+    valuearray_write(&vm.global_names, VALUE_MKOBJ(name));
+    valuearray_write(&vm.global_values, VALUE_MKUNDEF());
+    table_install(&vm.global_slots, name, VALUE_MKNUM(vm.global_values.size - 1));
+    vm_pop();
+    return vm.global_values.size - 1;
+}
+
 VECTOR_DEFINE_INIT(GrayStack, Obj *, graystack, stack)
 
 void graystack_write(GrayStack *arr, Obj *obj)
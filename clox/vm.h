@@ -1,6 +1,7 @@
 #ifndef VM_H_INCLUDED
 #define VM_H_INCLUDED
 
+#include <signal.h>
 #include <stddef.h>
 #include "chunk.h"
 #include "uint.h"
@@ -9,8 +10,15 @@
 #include "value.h"
 #include "vector.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX 256
+/*
+ * both stacks start small and grow as calls need them to. the value stack
+ * always keeps STACK_RESERVE slots free past what the running function
+ * may use, for natives and the vm's own temporaries.
+ */
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 1024
+#define STACK_RESERVE 16
+#define CALL_DEPTH_DEFAULT 100000
 
 typedef struct {
     ObjClosure *closure;
@@ -24,19 +32,78 @@ typedef struct {
     size_t cap;
 } GrayStack;
 
+/*
+ * new objects are bump allocated here. survivors of a minor collection
+ * are promoted to the old space (see heap.h).
+ */
+typedef struct {
+    u8 *start;
+    u8 *top;
+    u8 *end;
+    u64 *marks;     // a bit for every GC_NURSERY_GRANULE bytes
+} Nursery;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GCPhase;
+
+// pauses under 10us, 100us, 1ms, 10ms, 100ms and longer
+#define GC_PAUSE_BUCKETS 6
+
+typedef struct {
+    u64 start_time;
+    size_t minor_pauses;
+    size_t major_pauses;
+    u64 minor_time;     // all times in nanoseconds
+    u64 major_time;
+    u64 max_minor_pause;
+    u64 max_major_pause;
+    size_t compactions;
+    size_t collections;     // full ones, whose marking finished
+    size_t freed_bytes;     // of objects, young or old
+    size_t promoted_bytes;
+    size_t pause_histogram[GC_PAUSE_BUCKETS];
+} GCStats;
+
 typedef struct {
     const char *filename;
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     size_t frame_size;
-    Value stack[STACK_MAX];
+    size_t frame_cap;
+    size_t frame_limit;     // calls nest no deeper than this
+    Value *stack;
+    Value *stack_limit;     // STACK_RESERVE slots short of the end
+    size_t stack_cap;
     Value *sp;
-    Table globals;
+    bool jit;               // compile hot functions to machine code
+    Table global_slots;
+    ValueArray global_names;
+    ValueArray global_values;
     Table strings;
     ObjString *init_string;
+    ValueArray selectors;   // the name of each selector
+    ObjShape *empty_shape;
+    ObjClass *gc_stats_class;   // of what gcStats() returns
     ObjUpvalue *open_upvalues;
     size_t bytes_allocated;
     size_t next_gc;
-    Obj *objects;
+    size_t gc_initial_heap; // collections start there, and never go below
+    double gc_grow_factor;  // of the live heap, until the next collection
+    size_t gc_max_heap;     // 0 for no limit
+    Nursery nursery;
+    GrayStack remembered;   // old objects that may point into the nursery
+    // the nursery is full, or a snapshot was asked for: go to the next
+    // safepoint. the SIGUSR2 handler sets it too, hence the type
+    volatile sig_atomic_t gc_pending;
+    GCPhase gc_phase;
+    bool gc_incremental;    // spread full collections over many small steps
+    int gc_threads;         // threads marking in parallel, during pauses
+    bool gc_compact;        // defragment the heap when it gets sparse
+    bool gc_compact_pending;
+    size_t gc_debt;         // bytes allocated since the last incremental step
+    GCStats gc_stats;
     GrayStack gray_stack;
 } VM;
 
@@ -53,6 +120,7 @@ void vm_free();
 VMResult vm_interpret(const char *src, const char *filename);
 void vm_push(Value value);
 Value vm_pop();
+int vm_global_slot(ObjString *name);
 
 VECTOR_DECLARE_INIT(GrayStack, Obj *, graystack);
 VECTOR_DECLARE_WRITE(GrayStack, Obj *, graystack);